@@ -0,0 +1,428 @@
+/* ntzbench
+** Microbenchmarks for the kernels in ntzfind.cpp: evolveRow (and its low
+** and high halves), makeRow, the dedup index lookup,
+** getoffsetcount and lookAhead, over a range of widths and every
+** symmetry.  Each kernel is run on synthetic rows, or for lookAhead on
+** rows from random dives down a real search stack, and reported per
+** call in nanoseconds and, where the kernel lets us, hardware counters
+** (cycles, instructions, cache misses, branch misses, dTLB misses).
+** Without counters only the times are printed.
+**
+** g++ -std=c++11 -O3 -march=native -pthread -o ntzbench ntzbench.cpp
+*/
+#define NTZFIND_LIBRARY
+#include "ntzfind.cpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+#define NUMCOUNTERS 5
+static const char *counterNames[NUMCOUNTERS] = {
+   "cycles", "instrs", "cachemiss", "brmiss", "dtlbmiss"
+} ;
+
+/*
+ *   A set of hardware counters for this thread, user space only.  Any
+ *   counter the kernel or the machine won't give us reads as -1.
+ */
+class Counters {
+public:
+   Counters() {
+      for (int i=0; i<NUMCOUNTERS; i++)
+         fd[i] = -1 ;
+#ifdef __linux__
+      static const unsigned long long cfg[NUMCOUNTERS] = {
+         PERF_COUNT_HW_CPU_CYCLES,
+         PERF_COUNT_HW_INSTRUCTIONS,
+         PERF_COUNT_HW_CACHE_MISSES,
+         PERF_COUNT_HW_BRANCH_MISSES,
+         PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      } ;
+      for (int i=0; i<NUMCOUNTERS; i++) {
+         struct perf_event_attr pe ;
+         memset(&pe, 0, sizeof(pe)) ;
+         pe.size = sizeof(pe) ;
+         pe.type = i == NUMCOUNTERS - 1 ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE ;
+         pe.config = cfg[i] ;
+         pe.disabled = 1 ;
+         pe.exclude_kernel = 1 ;
+         pe.exclude_hv = 1 ;
+         fd[i] = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0) ;
+      }
+#endif
+   }
+   ~Counters() {
+#ifdef __linux__
+      for (int i=0; i<NUMCOUNTERS; i++)
+         if (fd[i] >= 0)
+            close(fd[i]) ;
+#endif
+   }
+   int any() {
+      for (int i=0; i<NUMCOUNTERS; i++)
+         if (fd[i] >= 0)
+            return 1 ;
+      return 0 ;
+   }
+   void start() {
+#ifdef __linux__
+      for (int i=0; i<NUMCOUNTERS; i++)
+         if (fd[i] >= 0) {
+            ioctl(fd[i], PERF_EVENT_IOC_RESET, 0) ;
+            ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0) ;
+         }
+#endif
+      t0 = get_wall_time() ;
+   }
+   void stop() {
+      seconds = get_wall_time() - t0 ;
+      for (int i=0; i<NUMCOUNTERS; i++) {
+         val[i] = -1 ;
+#ifdef __linux__
+         long long v ;
+         if (fd[i] >= 0) {
+            ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0) ;
+            if (read(fd[i], &v, sizeof(v)) == sizeof(v))
+               val[i] = v ;
+         }
+#endif
+      }
+   }
+   int fd[NUMCOUNTERS] ;
+   long long val[NUMCOUNTERS] ;
+   double t0, seconds ;
+} ;
+
+/*
+ *   The benchmarks themselves; a friend of RuleTable and Searcher so it
+ *   can call the kernels directly.
+ */
+class KernelBench {
+public:
+   KernelBench() : mt(1), sink(0) {}
+   void run(const char *rule, int width, int sym, const int *params) ;
+   long long memlimit ;
+   int threads ;
+   int compact ;
+private:
+   void report(const char *kernel, long long ops) ;
+   void benchEvolve(RuleTable &rt) ;
+   void benchMakeRow(RuleTable &rt) ;
+   void benchDedup(RuleTable &rt) ;
+   void benchOffsetCount(RuleTable &rt) ;
+   void benchLookAhead(Searcher &s) ;
+   int dive(Searcher &s, int queries) ;
+
+   Counters ctr ;
+   std::mt19937 mt ;
+   std::vector<int> built ;   // row12 values makeRow has been run on
+   int width ;
+   const char *symName ;
+   long long sink ;           // keeps results live
+} ;
+
+void KernelBench::report(const char *kernel, long long ops) {
+   if (ops <= 0)
+      ops = 1 ;
+   printf("w%-3d %-6s %-16s %10lld %10.1f", width, symName, kernel, ops,
+          1e9 * ctr.seconds / ops) ;
+   for (int i=0; i<NUMCOUNTERS; i++)
+      if (ctr.val[i] < 0)
+         printf(" %10s", "-") ;
+      else
+         printf(" %10.2f", (double)ctr.val[i] / ops) ;
+   if (ctr.val[0] > 0 && ctr.val[1] >= 0)
+      printf(" %5.2f", (double)ctr.val[1] / ctr.val[0]) ;
+   printf("\n") ;
+   fflush(stdout) ;
+}
+
+void KernelBench::benchEvolve(RuleTable &rt) {
+   int n = 1 << 20, mask = (1 << width) - 1 ;
+   int lowbitcount = (width >> 1) + 1 ;
+   int hibitcount = ((width + 1) >> 1) + 1 ;
+   std::vector<int> r(3 * n) ;
+   for (int i=0; i<3*n; i++)
+      r[i] = mt() & mask ;
+   long long sum = 0 ;
+   ctr.start() ;
+   for (int i=0; i<n; i++)
+      sum += rt.evolveRow(r[3*i], r[3*i+1], r[3*i+2]) ;
+   ctr.stop() ;
+   report("evolveRow", n) ;
+   ctr.start() ;
+   for (int i=0; i<n; i++)
+      sum += rt.evolveRowLow(r[3*i], r[3*i+1], r[3*i+2], lowbitcount-1) ;
+   ctr.stop() ;
+   report("evolveRowLow", n) ;
+   ctr.start() ;
+   for (int i=0; i<n; i++)
+      sum += rt.evolveRowHigh(r[3*i], r[3*i+1], r[3*i+2], hibitcount-1) ;
+   ctr.stop() ;
+   report("evolveRowHigh", n) ;
+   sink += sum ;
+}
+
+/*
+ *   Each makeRow() call evaluates 2^width successors, so the number of
+ *   calls shrinks as the width grows to keep the time per line similar.
+ */
+void KernelBench::benchMakeRow(RuleTable &rt) {
+   int n = width < 8 ? 1 << 14 : 1 << (22 - width) ;
+   long long pairs = 1LL << (2 * width) ;
+   if (n > pairs / 2)
+      n = (int)(pairs / 2) ;
+   built.clear() ;
+   while ((int)built.size() < n) {
+      int row12 = (int)(mt() & (pairs - 1)) ;
+      if (rt.gInd3[row12] == 0)
+         built.push_back(row12) ;
+   }
+   ctr.start() ;
+   for (int i=0; i<n; i++)
+      if (rt.gInd3[built[i]] == 0)
+         rt.makeRow(built[i] >> width, built[i] & ((1 << width) - 1)) ;
+   ctr.stop() ;
+   report("makeRow", n) ;
+}
+
+/*
+ *   Look up the fingerprints of lists that are already in the table, as
+ *   a rebuild would; the fingerprint itself is taken in evolveList().
+ */
+void KernelBench::benchDedup(RuleTable &rt) {
+   int n = (int)built.size() ;
+   std::vector<uint64_t> fps(n) ;
+   int *work = (int *)calloc(sizeof(int), 3LL << width) ;
+   for (int i=0; i<n; i++)
+      rt.evolveList(built[i] >> width, built[i] & ((1 << width) - 1), work, fps[i]) ;
+   free(work) ;
+   int reps = std::max(1, (1 << 20) / n) ;
+   long long found = 0 ;
+   ctr.start() ;
+   for (int r=0; r<reps; r++)
+      for (int i=0; i<n; i++) {
+         long long slot ;
+         found += rt.findList(fps[i], slot) != 0 ;
+      }
+   ctr.stop() ;
+   report("dedup lookup", (long long)reps * n) ;
+   sink += found ;
+}
+
+void KernelBench::benchOffsetCount(RuleTable &rt) {
+   int n = 1 << 22, m = (int)built.size() ;
+   std::vector<int> r12(n), r3(n) ;
+   for (int i=0; i<n; i++) {
+      r12[i] = built[mt() % m] ;
+      r3[i] = mt() & ((1 << width) - 1) ;
+   }
+   long long sum = 0 ;
+   ctr.start() ;
+   for (int i=0; i<n; i++) {
+      row_t *p ;
+      int cnt ;
+      rt.getoffsetcount(r12[i] >> width, r12[i] & ((1 << width) - 1), r3[i], p, cnt) ;
+      sum += cnt ;
+      if (cnt)
+         sum += *p ;
+   }
+   ctr.stop() ;
+   report("getoffsetcount", n) ;
+   sink += sum ;
+}
+
+/*
+ *   Random dives: from the empty initial rows, try a random row from the
+ *   successor list at each depth, go one deeper when lookAhead() accepts
+ *   it and start over when a list is empty or a few tries fail.  This
+ *   is the stack search() would build, minus the ordering.  Returns the
+ *   number of lookAhead() calls made.
+ */
+int KernelBench::dive(Searcher &s, int queries) {
+   int p = s.period ;
+   int bottom = 2 * p ;
+   int top = std::min(s.sp[P_DEPTH_LIMIT] - 1, bottom + 10 * p) ;
+   int a = bottom, tries = 0, made = 0 ;
+   std::vector<int> count(top + 1) ;
+   row_t *zeroRows ;
+   int numZero ;
+   s.getoffsetcount(0, 0, 0, zeroRows, numZero) ;
+   s.pInd[a] = zeroRows ;
+   count[a] = numZero ;
+   while (made < queries) {
+      if (count[a] == 0 || tries > 4) {
+         a = bottom ;
+         s.pInd[a] = zeroRows ;
+         count[a] = numZero ;
+         tries = 0 ;
+         continue ;
+      }
+      s.phase = a % p ;
+      // lookAhead() may refer to a row by its place in the list
+      int k = mt() % count[a] ;
+      s.pRemain[a] = k ;
+      s.pRows[a] = s.pInd[a][k] ;
+      int ok = s.lookAhead(a) ;
+      made++ ;
+      if (!ok || a == top) {
+         tries++ ;
+         continue ;
+      }
+      a++ ;
+      tries = 0 ;
+      int ph = a % p ;
+      s.getoffsetcount(s.pRows[a - 2 * p], s.pRows[a - p],
+#ifdef KNIGHT
+                       s.pRows[a - p + s.backOff[ph]] >> s.kshiftb[ph],
+#else
+                       s.pRows[a - p + s.backOff[ph]],
+#endif
+                       s.pInd[a], count[a]) ;
+   }
+   return made ;
+}
+
+/*
+ *   The same dives are run twice; the first builds the lists they touch
+ *   and the second, with an empty lookahead cache, is timed.  The time
+ *   includes choosing the rows, which is small next to lookAhead().
+ *   Wide dives touch a new list almost every call, so fewer are made.
+ */
+void KernelBench::benchLookAhead(Searcher &s) {
+   int n = width <= 10 ? 1 << 18 : 1 << (38 - 2 * width) ;
+   std::mt19937 saved = mt ;
+   dive(s, n) ;
+   mt = saved ;
+   memset(s.cache, 0, sizeof(*s.cache) * s.cachesize) ;
+   ctr.start() ;
+   int made = dive(s, n) ;
+   ctr.stop() ;
+   report("lookAhead", made) ;
+}
+
+void KernelBench::run(const char *rule, int w, int sym, const int *params) {
+   static const char *names[] = { "", "asym", "odd", "even", "gutter" } ;
+   width = w ;
+   symName = names[sym] ;
+   RuleTable rt ;
+   rt.memlimit = memlimit ;
+   rt.threads = threads ;
+   rt.compact = compact ;
+   if (rt.setRule(rule) != 0) {
+      printf("Failed to parse rule %s\n", rule) ;
+      exit(10) ;
+   }
+   TablePlan tp ;
+   rt.plan(w, sym, tp) ;
+   if (tp.indexBytes > memlimit) {
+      printf("w%-3d %-6s skipped: the index alone needs %lld MB\n", w, symName, tp.indexBytes >> 20) ;
+      return ;
+   }
+   const char *err = rt.build(w, sym, 1) ;
+   if (err) {
+      printf("w%-3d %-6s skipped: %s\n", w, symName, err) ;
+      return ;
+   }
+   benchEvolve(rt) ;
+   benchMakeRow(rt) ;
+   if (rt.failed) {
+      printf("w%-3d %-6s %s\n", w, symName, rt.failed) ;
+      return ;
+   }
+   benchDedup(rt) ;
+   benchOffsetCount(rt) ;
+   int sp[NUM_PARAMS] ;
+   for (int i=0; i<NUM_PARAMS; i++)
+      sp[i] = params[i] ;
+   sp[P_WIDTH] = w ;
+   sp[P_SYMMETRY] = sym ;
+   sp[P_REORDER] = 1 ;
+   Searcher s(rt) ;
+   err = s.init(sp, 0) ;
+   if (err == 0)
+      err = s.start() ;
+   if (err == 0)
+      benchLookAhead(s) ;
+   if (rt.failed)
+      err = rt.failed ;
+   if (err)
+      printf("w%-3d %-6s %s\n", w, symName, err) ;
+}
+
+void usage(){
+   printf("Usage: ntzbench [options]\n") ;
+   printf("  bRULE  rule to use (default B3/S23)\n") ;
+   printf("  wNN    smallest width (default 4)\n") ;
+   printf("  WNN    largest width (default 14)\n") ;
+   printf("  a u v g  symmetries to run (default all)\n") ;
+   printf("  pNN kNN  period and offset for lookAhead (default p4 k1)\n") ;
+   printf("  RNNN   skips widths whose tables need more than NNN megabytes\n") ;
+   printf("         (default 4096)\n") ;
+   printf("  hNN    uses NN threads to build the tables\n") ;
+   printf("  c      uses the compact list layout\n") ;
+}
+
+int main(int argc, char *argv[]){
+   const char *rule = "B3/S23" ;
+   int wmin = 4, wmax = 14 ;
+   int syms[5], nsyms = 0 ;
+   int sp[NUM_PARAMS] ;
+   for (int i=0; i<NUM_PARAMS; i++)
+      sp[i] = 0 ;
+   sp[P_PERIOD] = 4 ;
+   sp[P_OFFSET] = 1 ;
+   sp[P_DEPTH_LIMIT] = DEFAULT_DEPTH_LIMIT ;
+   KernelBench kb ;
+   kb.memlimit = 4096LL << 20 ;
+   kb.threads = 1 ;
+   kb.compact = 0 ;
+   long long mb ;
+   for (int s=1; s<argc; s++) {
+      switch (argv[s][0]) {
+         case 'b': case 'B': rule = argv[s]; break ;
+         case 'w': sscanf(&argv[s][1], "%d", &wmin); break ;
+         case 'W': sscanf(&argv[s][1], "%d", &wmax); break ;
+         case 'a': case 'A': syms[nsyms++ % 5] = SYM_ASYM; break ;
+         case 'u': case 'U': syms[nsyms++ % 5] = SYM_ODD; break ;
+         case 'v': case 'V': syms[nsyms++ % 5] = SYM_EVEN; break ;
+         case 'g': case 'G': syms[nsyms++ % 5] = SYM_GUTTER; break ;
+         case 'p': case 'P': sscanf(&argv[s][1], "%d", &sp[P_PERIOD]); break ;
+         case 'k': case 'K': sscanf(&argv[s][1], "%d", &sp[P_OFFSET]); break ;
+         case 'R': sscanf(&argv[s][1], "%lld", &mb); kb.memlimit = mb << 20; break ;
+         case 'h': case 'H': sscanf(&argv[s][1], "%d", &kb.threads); if (kb.threads < 1) kb.threads = 1; break ;
+         case 'c': case 'C': kb.compact = 1; break ;
+         default:
+            usage() ;
+            exit(10) ;
+      }
+   }
+   if (nsyms == 0) {
+      syms[nsyms++] = SYM_ASYM ;
+      syms[nsyms++] = SYM_ODD ;
+      syms[nsyms++] = SYM_EVEN ;
+      syms[nsyms++] = SYM_GUTTER ;
+   }
+   if (nsyms > 5)
+      nsyms = 5 ;
+   if (wmin < 4)
+      wmin = 4 ;
+   if (wmax > MAXROWBITS)
+      wmax = MAXROWBITS ;
+   Counters probe ;
+   if (!probe.any())
+      printf("Hardware counters unavailable; reporting times only\n") ;
+   printf("%-4s %-6s %-16s %10s %10s", "w", "sym", "kernel", "calls", "ns/call") ;
+   for (int i=0; i<NUMCOUNTERS; i++)
+      printf(" %10s", counterNames[i]) ;
+   printf(" %5s\n", "IPC") ;
+   for (int w=wmin; w<=wmax; w++)
+      for (int i=0; i<nsyms; i++)
+         kb.run(rule, w, syms[i], sp) ;
+   return 0 ;
+}
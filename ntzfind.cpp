@@ -2,17 +2,51 @@
 ** A spaceship search program by "zdr" with modifications by Matthias Merzenich and Aidan Pierce and Tomas Rokicki
 **
 ** Warning: this program uses a lot of memory (especially for wide searches).
+**
+** The search engine is usable as a library: define NTZFIND_LIBRARY and
+** include this file to get the RuleTable and Searcher classes without
+** main().  A RuleTable holds everything that depends only on the rule,
+** width, symmetry and search order, and can be shared by any number of
+** Searchers; results come back through a SearchListener.
 */
 
 /* define or undef KNIGHT to include knight support */
 #define KNIGHT
 
+/* define NARROW to store rows and successor lists in bytes (width <= 8) */
+#ifdef NARROW
+typedef unsigned char row_t ;
+#define MAXROWBITS 8
+#else
+typedef unsigned short row_t ;
+#define MAXROWBITS 16
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 #include <random>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "tab.cpp"
 
 #define BANNER "ntzfind 3.0 by \"zdr\", Matthias Merzenich, Aidan Pierce, and Tomas Rokicki, 24 February 2018"
@@ -44,7 +78,13 @@
 #define SYM_EVEN 3
 #define SYM_GUTTER 4
 
-const char *rule = "B3/S23" ;
+/* values returned by Searcher::search() */
+#define SEARCH_COMPLETE 0   // whole search space exhausted
+#define SEARCH_SHIPS 1      // the requested number of ships was found
+#define SEARCH_DEPTH 2      // depth limit reached
+#define SEARCH_ERROR 3      // see Searcher::lastError
+#define SEARCH_LIMIT 4      // node or time budget used up
+#define SEARCH_RUNNING (-1) // from step(): not finished yet
 
 /* get_cpu_time() definition taken from
 ** http://stackoverflow.com/questions/17432502/how-can-i-measure-cpu-time-and-wall-clock-time-on-both-linux-windows/17440673#17440673
@@ -74,71 +114,41 @@ double get_cpu_time(){
 }
 #endif
 
-int nttable[512] ;
-int sp[NUM_PARAMS];
-uint16_t **pInd ;
-uint16_t **gInd3 ;
-int *pRemain;
-uint32_t *gcount ;
-uint16_t *gRows, *pRows;
-uint16_t *ev2Rows;               // lookup table that gives the evolution of a row with a blank row above and a specified row below
-int *lastNonempty;
-unsigned long long dumpPeriod;
-long long memusage ;
-long long memlimit = 0x7000000000000000LL ;
-int bc[8] = {0, 1, 1, 2, 1, 2, 2, 3};
-char *buf;
-
-int period, offset, width, rowNum, loadDumpFlag;
-int shipNum, firstFull;
-uint16_t fpBitmask = 0;
-
-int phase, fwdOff[MAXPERIOD], backOff[MAXPERIOD], doubleOff[MAXPERIOD], tripleOff[MAXPERIOD];
-
-void error(const char *s) {
-   fprintf(stderr, "%s\n", s) ;
-   exit(10) ;
-}
-
-void makePhases(){
-   int i;
-   for (i = 0; i < period; i++) backOff[i] = -1;
-   i = 0;
-   for (;;) {
-      int j = offset;
-      while (backOff[(i+j)%period] >= 0 && j < period) j++;
-      if (j == period) {
-         backOff[i] = period-i;
-         break;
-      }
-      backOff[i] = j;
-      i = (i+j)%period;
-   }
-   for (i = 0; i < period; i++)
-      fwdOff[(i+backOff[i])%period] = backOff[i];
-   for (i = 0; i < period; i++) {
-      int j = (i - fwdOff[i]);
-      if (j < 0) j += period;
-      doubleOff[i] = fwdOff[i] + fwdOff[j];
-   }
-   for (i = 0; i <  period; i++){
-      int j = (i - fwdOff[i]);
-      if (j < 0) j += period;
-      tripleOff[i] = fwdOff[i] + doubleOff[j];
-   }
+double get_wall_time(){
+   return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-/*
-** For each possible phase of the ship, equivRow[phase] gives the row that 
-** is equivalent if the pattern is subperiodic with a specified period.
-** equivRow2 is necessary if period == 12, 24, or 30, as then two subperiods
-** need to be tested (e.g., if period == 12, we must test subperiods 4 and 6).
-** twoSubPeriods is a flag that tells the program to test two subperiods.
-*/
+// the resident set size in bytes, or 0 where that can't be read
+long long get_resident_bytes(){
+   long long pages = 0, resident = 0;
+   FILE *f = fopen("/proc/self/statm", "r");
+   if (f == 0)
+      return 0;
+   if (fscanf(f, "%lld %lld", &pages, &resident) != 2)
+      resident = 0;
+   fclose(f);
+#ifdef _WIN32
+   return 0;
+#else
+   return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
 
-int equivRow[MAXPERIOD];
-int equivRow2[MAXPERIOD];
-int twoSubPeriods = 0;
+/*
+ *   Run fn(0) .. fn(n-1) each on its own thread and wait for them all.
+ */
+template <class F> void runThreads(int n, F fn) {
+   if (n <= 1) {
+      fn(0) ;
+      return ;
+   }
+   std::vector<std::thread> th ;
+   for (int t=0; t<n; t++)
+      th.push_back(std::thread(fn, t)) ;
+   for (int t=0; t<n; t++)
+      th[t].join() ;
+}
 
 int gcd(int a, int b){
    int c;
@@ -156,36 +166,597 @@ int smallestDivisor(int b){
    return c;
 }
 
-void makeEqRows(int maxFactor, int a){
-   int tempEquivRow[MAXPERIOD];
-   int i,j;
-   for(i = 0; i < period; ++i){
-      tempEquivRow[i] = i;
-      for(j = 0; j < maxFactor; ++j){
-         tempEquivRow[i] += backOff[tempEquivRow[i] % period];
+/*
+ *   The compact list layout (RuleTable::compact) replaces the 1+2^width
+ *   dense offsets with a bitmap of the evolved rows that have any row3,
+ *   64 to a word, then for each word the number of bits set before it,
+ *   then the number of bits set less one, then an offset for each set
+ *   bit and one more.  Offsets are relative to the row values, which
+ *   follow, and everything but the bitmap is taken modulo the size of a
+ *   row_t, as in the dense layout.  An empty bucket gets the same
+ *   pointer it would in the dense layout, so cache keys don't change.
+ */
+static inline void compactOffsetCount(row_t *row, int words, int row3, row_t* &p, int &n) {
+   uint64_t word = ((const uint64_t *)row)[row3 >> 6] ;
+   uint64_t bit = 1ULL << (row3 & 63) ;
+   row_t *rank = row + words * (sizeof(uint64_t) / sizeof(row_t)) ;
+   row_t *offs = rank + words + 1 ;
+   int r = rank[row3 >> 6] + __builtin_popcountll(word & (bit - 1)) ;
+   p = offs + (row_t)rank[words] + 2 + offs[r] ;
+   n = (word & bit) ? (row_t)(offs[r+1] - offs[r]) : 0 ;
+}
+static inline int compactNonempty(const row_t *row, int row3) {
+   return (((const uint64_t *)row)[row3 >> 6] >> (row3 & 63)) & 1 ;
+}
+
+/*
+ *   The predicted cost of a table, as worked out by RuleTable::plan().
+ */
+struct TablePlan {
+   long long indexBytes ;     // gInd3, ev2Rows, gcount and the list index
+   long long arenaBytes ;     // successor arena if every list gets built
+   long long lists ;          // estimated number of distinct lists
+   double avgLen ;            // row_t entries in an average distinct list
+   int samples ;              // (row1, row2) pairs evaluated
+   int exact ;                // all pairs were evaluated
+} ;
+
+/*
+ *   The header of a table in POSIX shared memory (RuleTable::sharedName).
+ *   Every process maps the segment at the same address, so the list
+ *   pointers in it are good everywhere.  The tables follow the header and
+ *   the list arena follows them; lock guards the arena, the dedup index
+ *   and the publishing of new lists.
+ */
+struct SharedTable {
+   char magic[8] ;           // SHAREDMAGIC once the creator has set up the lock
+   void *base ;              // where every process maps the segment
+   long long size, used ;    // bytes in the segment, and allocated so far
+#ifndef _WIN32
+   pthread_mutex_t lock ;
+#endif
+   int ready ;               // the creator has finished build()
+   int width, symmetry, reorder, contexts, compact, fold, rowBytes ;
+   char nttable2[512] ;
+   row_t **gInd3 ;
+   row_t *ev2Rows ;
+   row_t *valorder ;
+   uint64_t *listFp ;
+   uint32_t *listRow ;
+   long long listIndexSize, listIndexUsed ;
+} ;
+#define SHAREDMAGIC "NTZSHM1"
+
+/*
+ *   Everything that depends only on the rule, the width, the symmetry and
+ *   the search order: the transition tables, the lazily built successor
+ *   lists and the arena they live in.  Any number of Searchers with
+ *   different periods, offsets and limits can share one RuleTable.  A
+ *   lazily built table grows as it is read, through scratch space of
+ *   its own (gWork, gScratch), so it must only be used from one thread
+ *   at a time; lockShared() only guards against other processes using
+ *   a shared-memory table.  An eagerly built table (eager) is read-only
+ *   once build() returns, and Searchers on several threads can use it
+ *   at once, as --seeds and --rules do; they add their own allocations
+ *   through addUsage().  relayout() moves every list, so it is only for
+ *   a table one search is using.
+ */
+class RuleTable {
+public:
+   RuleTable() ;
+   ~RuleTable() ;
+   const char *setRule(const char *rule) ;
+   const char *build(int width, int symmetry, int reorder) ;
+   const char *plan(int width, int symmetry, TablePlan &tp) ;
+   row_t *getoffset(int row12) {
+      row_t *r = gInd3[row12] ;
+      if (r == 0)
+         r = makeRow(row12 >> width, row12 & ((1 << width) - 1)) ;
+      return r ;
+   }
+   row_t *getoffset(int row1, int row2) {
+      return getoffset((row1 << width) + row2) ;
+   }
+   // in a folded table, 1 if (row1, row2) shares its mirror image's list
+   int mirrored(int row1, int row2) {
+      return fold && (revRow[row1] << width) + revRow[row2] < (row1 << width) + row2 ;
+   }
+   /*
+    *   A list is 1+2^width offsets, relative to the start of the row
+    *   values that follow them, so they fit in a row_t.  Counts are
+    *   taken modulo the size of a row_t for the same reason.  See
+    *   compactOffsetCount() for the compact layout.  For a mirrored
+    *   pair the rows come back mirrored (see fold).
+    */
+   void getoffsetcount(int row1, int row2, int row3, row_t* &p, int &n) {
+      row_t *row = getoffset(row1, row2) ;
+      if (mirrored(row1, row2))
+         row3 = revRow[row3] ;
+      if (compact) {
+         compactOffsetCount(row, mapWords, row3, p, n) ;
+         return ;
       }
-      tempEquivRow[i] -= offset * maxFactor + i;
-      if(a == 1) equivRow[i] = tempEquivRow[i];
-      else equivRow2[i] = tempEquivRow[i];
+      p = row + (1 << width) + 1 + row[row3] ;
+      n = (row_t)(row[row3+1] - row[row3]) ;
    }
-   for(i = 0; i < period; ++i){     // make equivRow[i] negative if possible
-      if(tempEquivRow[i] > 0){
-         if(a == 1) equivRow[i + tempEquivRow[i]] = -1 * tempEquivRow[i];
-         else equivRow2[i + tempEquivRow[i]] = -1 * tempEquivRow[i];
+   int getcount(int row1, int row2, int row3) {
+      row_t *p ;
+      int n ;
+      getoffsetcount(row1, row2, row3, p, n) ;
+      return n ;
+   }
+
+   char rule[256] ;
+   int nttable[512] ;
+   char nttable2[512] ;
+   int width, symmetry, reorder, built ;
+   row_t **gInd3 ;
+   row_t *ev2Rows ;    // lookup table that gives the evolution of a row with a blank row above and a specified row below
+   uint32_t *gcount ;
+   row_t *valorder ;   // one order of 2^width rows per context; see contextOf()
+   long long memusage ;
+   int compact ;        // lay lists out compactly (see compactOffsetCount()); set before build()
+   int mapWords ;       // bitmap words per compact list
+   int fold ;           // asymmetric tables only: store one list per mirror-image pair; set before build()
+   row_t *revRow ;      // each row mirrored, for fold
+   long long listBytes ;   // in the lists stored so far
+   long long listGood ;    // rows in them, for sizing the other layout
+   long long listCompact ; // row_t entries they would take laid out compactly
+   long long memlimit ;
+   const char *failed ;   // set once the table can't grow; the search then winds down
+   int threads ;          // threads used to build the tables
+   int eager ;            // build every list up front instead of on demand
+   int contexts ;         // population classes with their own order (search order 4)
+   double buildTime ;     // wall-clock seconds spent in build()
+   long long listsMade, listsStored ;      // lists computed, and distinct ones kept
+   long long listLookups, listProbes ;     // dedup index lookups and slots probed
+   long long listCollisions ;              // fingerprint matches whose lists differed
+   int listMaxProbe ;
+   const char *sharedName ;   // if set, build() creates or attaches to this shared-memory table
+   const char *listStats(char *buf) ;
+   long long otherLayoutBytes() ;
+   const char *relayout(const uint32_t *hits, char *report) ;
+   void profile(const uint32_t *hits, int top, std::vector<std::string> &lines) ;
+   // for a search's own allocations; searches in threads share the table
+   void addUsage(long long bytes) {
+      std::lock_guard<std::mutex> lock(tableLock) ;
+      memusage += bytes ;
+   }
+private:
+   int slowEvolveBit(int row1, int row2, int row3, int bshift) ;
+   void fasterTable() ;
+   int evolveBit(int row1, int row2, int row3, int bshift) ;
+   int evolveBit(int row1, int row2, int row3) ;
+   int evolveRow(int row1, int row2, int row3) ;
+   int evolveRowHigh(int row1, int row2, int row3, int bits) ;
+   int evolveRowLow(int row1, int row2, int row3, int bits) ;
+   void sortRows(row_t *row, uint32_t totalRows) ;
+   void genStatCounts() ;
+   void genContextOrders() ;
+   void setupFold() ;
+   // lists for (row1, row2) use the order for row2's population class
+   int contextOf(int row2) {
+      if (reorder != 4 || contexts <= 1)
+         return 0 ;
+      int c = __builtin_popcount(row2) ;
+      return c < contexts ? c : contexts - 1 ;
+   }
+   row_t *bmalloc(int siz) ;
+   void unbmalloc(int siz) ;
+   int evolveList(int row1, int row2, int *work, uint64_t &fp) ;
+   int listSize(int good, int *work) ;
+   int storedSize(const row_t *row) ;
+   int compactSize(int buckets, int good) ;
+   void countList(const row_t *row, int good) ;
+   int storedGood(const row_t *row) ;
+   void fillList(row_t *row, int good, int *work) ;
+   int sameList(const row_t *row, int good, int *work, row_t *scratch) ;
+   row_t *findList(uint64_t fp, long long &slot) ;
+   void addList(long long slot, uint64_t fp, int row12) ;
+   row_t *makeRow(int row1, int row2) ;
+   void buildLists(int n) ;
+   void *tableAlloc(long long bytes) ;
+   const char *openShared() ;
+   void lockShared() ;
+   void unlockShared() ;
+
+   int *gWork ;
+   row_t *gScratch ;    // a list laid out by makeRow() to check a fingerprint match
+   row_t *bbuf ;
+   int bbuf_left ;
+   std::vector<row_t *> chunks ;
+   std::vector<long long> chunkUsed ;   // bytes handed out from each chunk
+   std::vector<long long> chunkBytes ;  // and its size
+   row_t *emptyRow ;   // handed out instead of a list once memory runs out
+   /*
+    *   The dedup index.  A list is identified by a 64-bit fingerprint of
+    *   its (row4, row3) pairs, taken as it is computed, so duplicates are
+    *   found without building or comparing them.  listRow holds a pair
+    *   whose gInd3 entry is the list; a fingerprint of 0 marks an empty
+    *   slot.  Open addressing, at most 3/4 full; freed after an eager
+    *   build.
+    */
+   uint64_t *listFp ;
+   uint32_t *listRow ;
+   long long listIndexSize ;
+   std::mutex tableLock ;
+   SharedTable *shm ;   // the shared-memory table, if any
+   friend class KernelBench ;   // ntzbench.cpp
+} ;
+
+class Searcher ;
+/*
+ *   Everything a Searcher finds or reports goes through one of these.
+ *   The default implementation prints to stdout exactly what ntzfind
+ *   always has; embedders override the calls they care about.  Depths
+ *   are in rows below the initial rows, or -1 if there is no depth to
+ *   report.
+ */
+class SearchListener {
+public:
+   virtual ~SearchListener() {}
+   virtual void partial(Searcher &s, const char *pat) ;
+   virtual void ship(Searcher &s, const char *pat, int shipCount) ;
+   virtual void progress(Searcher &s, int depth, unsigned long long calcs, double cpuTime) ;
+   virtual void finished(Searcher &s, int result, int shipCount, int depth) ;
+   virtual void message(Searcher &s, const char *msg) ;
+} ;
+
+/*
+ *   The ships found so far, by the key Searcher::shipKey() gives them,
+ *   so repeats can be recognised.  If a file is given the keys are read
+ *   from it and new ones appended, so this spans runs.  Any number of
+ *   Searchers on any number of threads can share one.
+ */
+class KnownShips {
+public:
+   KnownShips() : skip(0), fp(0) {}
+   ~KnownShips() { if (fp) fclose(fp) ; }
+   const char *open(const char *filename) ;
+   int add(uint64_t key) ;     // 1 if the key is new
+   int skip ;                  // don't look for tagalongs behind a repeat either
+private:
+   std::unordered_set<uint64_t> keys ;
+   FILE *fp ;
+   std::mutex lock ;
+} ;
+
+/*
+ *   The campaign index: one line per finished search (not one stopped by
+ *   a node or time limit), keyed on the transition table and on the
+ *   parameters as Searcher::init() normalized them, so later runs can be
+ *   answered without searching.  A search that was exhausted answers any
+ *   search of the same tree with a depth limit at least as high (it
+ *   never got that deep) and, if it found nothing, any narrower one too
+ *   (a narrower search is the wider one with the outer columns empty).
+ *   A search stopped by ships or the depth limit depends on the search
+ *   order, so it only answers the same search in the same order.  Lines
+ *   are appended and flushed one at a time, so several processes can
+ *   share a file.
+ */
+class Campaign {
+public:
+   struct Entry {
+      std::string table ;      // the transition table, in hex
+      int p, k, w, y, l, m, f, t, x, n ;   // the normalized sp[]: y is the symmetry, n the knight phase
+      int o, c, q, d, s ;      // the search order, contexts, queue megabytes, discrepancies and ships wanted
+      int fold ;               // whether the table was folded, which reorders mirrored lists
+      int result, ships, depth ;
+      std::string note ;       // the rule, the work and the date, for people
+   } ;
+   Campaign() : fp(0) {}
+   ~Campaign() { if (fp) fclose(fp) ; }
+   const char *open(const char *filename) ;
+   // the result e would have, with its ships and depth, or SEARCH_RUNNING
+   int lookup(const Entry &e, int &ships, int &depth, std::string &why) ;
+   void add(const Entry &e) ;
+private:
+   std::vector<Entry> entries ;
+   FILE *fp ;
+   std::mutex lock ;
+} ;
+
+/*
+ *   One search: the parameters, the search stack and the lookahead cache.
+ *   Call init() with the parameters, then start() to attach the rule table
+ *   and seed the stack, then search().  Errors are returned as strings
+ *   (or SEARCH_ERROR with lastError set); nothing here calls exit().
+ *   To run several searches on one thread, call beginSearch() instead of
+ *   search() and then step() each in turn until it returns something
+ *   other than SEARCH_RUNNING.
+ */
+class Searcher {
+public:
+   Searcher(RuleTable &rt, SearchListener *listener = 0) ;
+   ~Searcher() ;
+   const char *init(const int *params, const char *initRowsFile) ;
+   const char *loadState(const char *cmd, const char *file) ;
+   const char *start() ;
+   const char *plan(long long budget) ;
+   const char *startTrace(const char *file) ;
+   const char *replay(const char *file) ;
+   const char *dumpState(int v) ;
+   void setInitRows(const row_t *rows) ;
+   void echoParams() ;
+   int search() ;
+   void beginSearch() ;
+   int step() ;
+
+   RuleTable *rt ;
+   SearchListener *listener ;
+   const char *lastError ;
+   int sp[NUM_PARAMS] ;
+   int period, offset, width, rowNum ;
+   int cachemem ;              // megabytes for the cache; -1 to size it with plan()
+   int memomem ;               // megabytes for the inner lookahead memo; 0 for none
+   int queuemem ;              // megabytes for the breadth-first queue; 0 to search depth-first
+   int relayoutSeconds ;       // seconds into search() to relayout() the table; 0 for never
+   int profile ;               // -1, or report table use after search() listing this many hot entries
+   int ldsMax ;                // -1, or first search paths with at most 0, 1, ... this many discrepancies
+   int dumpFlag ;              // Dump status flags, possible values follow
+#define DUMPPENDING (1)
+#define DUMPFAILURE (2)
+#define DUMPSUCCESS (3)
+   int dumpNum ;
+   char dumpFile[12] ;
+   char *buf ;
+   row_t *pRows ;
+   unsigned long long calcs ;  // times through the main loop so far
+   unsigned long long cacheLookups, cacheHits ;  // lookahead cache statistics
+   unsigned long long memoLookups, memoHits ;    // and the inner memo's
+   int reportInterval ;        // seconds between progress reports; 0 for none
+   unsigned long long maxCalcs ;  // stop after this many calculations
+   int maxSeconds ;            // or after this many seconds; 0 for no limit
+   KnownShips *known ;         // if set, ships already in it are not reported
+   int knownShips ;            // repeats not reported
+   Campaign *campaign ;        // if set, search() answers from it what it can and records the rest
+   const char *controlFile ;   // if set, search() tightens m, t, s and l from this file as it changes
+   volatile sig_atomic_t reportPending ;  // set (e.g. from a signal handler) to get a report soon
+private:
+   struct cacheentry {
+      row_t *p1, *p2, *p3 ;
+      int abn, r ;
+   } ;
+   struct memoentry {
+      row_t *p22, *p23 ;
+      int row13, r ;
+   } ;
+   void makePhases() ;
+   void makeEqRows(int maxFactor, int a) ;
+#ifdef KNIGHT
+   void makekshift(int a) ;
+#endif
+   void buffPattern(const row_t *rows, int theRow) ;
+   int getkey(row_t *p1, row_t *p2, row_t *p3, int abn) ;
+   void setkey(int h, int v) ;
+   int getmemo(row_t *p22, row_t *p23, int row13) ;
+   int lookAhead(int a) {
+      return fold ? lookAheadT<1>(a) : lookAheadT<0>(a) ;
+   }
+   template <int FOLD> int lookAheadT(int a) ;
+   FILE *openDumpFile() ;
+   int checkInteract(int a) ;
+   int checkPalindrome(int v) ;
+   uint64_t shipKey(int theRow) ;
+   void prefetchAhead(int a, int stage) ;
+   void relayout(int a) ;
+   void profileReport() ;
+   void finish(int result, int shipCount, int depth) ;
+   int applyControl(int a, int totalShips) ;
+   void campaignEntry(Campaign::Entry &e) ;
+   template <int YIELD> int searchLoop() ;
+   int hybridSearch() ;
+   int ldsSearch() ;
+   int hybridLoop() ;
+   int rowOk(int a, int &palin) ;
+   void qwindow(uint32_t node, int a) ;
+   void qpath(uint32_t node, int a) ;
+   uint32_t qhashRows(int a, int palin) ;
+   int qsame(uint32_t node, int a, int palin) ;
+   int qprobe(uint32_t node, int a, int limit, int report, int &result) ;
+   int qship(int end) ;
+   int qtick(uint32_t node, int d, int a) ;
+   void qcollect(std::vector<uint32_t> &level, uint32_t &qsize) ;
+   const char *loadInitRows(const char *file) ;
+   signed int loadInt(FILE *fp) ;
+   long long loadUL(FILE *fp) ;
+   // local copies of the table lookups; gInd3 never moves once built
+   row_t *getoffset(int row1, int row2) {
+      int row12 = (row1 << width) + row2 ;
+      if (hits)
+         hits[row12] += hits[row12] != 0xffffffff ;
+      row_t *r = gInd3[row12] ;
+      if (r == 0)
+         r = rt->getoffset(row1, row2) ;
+      return r ;
+   }
+   void getoffsetcount(int row1, int row2, int row3, row_t* &p, int &n) {
+      row_t *row = getoffset(row1, row2) ;
+      if (compact) {
+         compactOffsetCount(row, mapWords, row3, p, n) ;
+         return ;
       }
+      p = row + (1 << width) + 1 + row[row3] ;
+      n = (row_t)(row[row3+1] - row[row3]) ;
+   }
+   int nonempty(const row_t *row, int row3) {
+      if (compact)
+         return compactNonempty(row, row3) ;
+      return row[row3+1] != row[row3] ;
+   }
+   // in a folded table (RuleTable::fold) a mirrored pair reads its
+   // mirror image's list: row3 is mirrored on the way in, and m is set
+   // to say the rows that come back need mirroring too.  FOLD 0 is for
+   // code that has already checked the table isn't folded.
+   int mirrored(int row1, int row2) {
+      return fold && (revRow[row1] << width) + revRow[row2] < (row1 << width) + row2 ;
+   }
+   template <int FOLD> void getoffsetcount(int row1, int row2, int row3, row_t* &p, int &n, unsigned char &m) {
+      m = FOLD && mirrored(row1, row2) ;
+      getoffsetcount(row1, row2, m ? revRow[row3] : row3, p, n) ;
+   }
+   // one row from a list read with m set as above
+   row_t unfold(int m, row_t row) {
+      return m ? revRow[row] : row ;
    }
+   // a list pointer tagged with its m, for cache keys
+   static row_t *tag(row_t *p, int m) {
+      return (row_t *)((uintptr_t)p ^ ((uintptr_t)m << (8 * sizeof(uintptr_t) - 1))) ;
+   }
+
+   row_t **gInd3 ;
+   int compact, mapWords ;
+   int fold ;
+   row_t *revRow ;
+   row_t **pInd ;
+   int *pRemain ;
+   unsigned char *pMir ;    // whether each pInd list is read mirrored
+   row_t *snapRows ;        // copy of pRows as of the last partial worth showing
+   int snapRow ;
+   int *lastNonempty ;
+   unsigned long long dumpPeriod ;
+   int shipNum, firstFull ;
+   row_t fpBitmask ;
+   int phase, fwdOff[MAXPERIOD], backOff[MAXPERIOD], doubleOff[MAXPERIOD], tripleOff[MAXPERIOD] ;
+   int equivRow[MAXPERIOD] ;
+   int equivRow2[MAXPERIOD] ;
+   int twoSubPeriods ;
+#ifdef KNIGHT
+   int kshiftb[MAXPERIOD], kshift0[MAXPERIOD], kshift1[MAXPERIOD],
+       kshift2[MAXPERIOD], kshift3[MAXPERIOD] ;
+#endif
+   long long cachesize ;
+   cacheentry *cache ;
+   long long memosize ;
+   memoentry *memo ;
+   int loadFailed ;
+   // the hybrid engine's queue: every partial still open, one level per
+   // row, each node just its last row and the index of its parent
+   struct qnode {
+      uint32_t parent ;     // QPALIN set while every row so far is a palindrome
+      row_t row ;
+   } ;
+#define QPALIN (0x80000000u)
+#define QINDEX (0x7fffffffu)
+#define QDEAD (0xffffffffu)
+   qnode *queue ;
+   uint32_t *qhash ;        // the level being built, by its last 2*period rows
+   long long qcap, qmask ;
+   row_t *rowSelf ;         // rowSelf[r] == r: stands in for pInd on rows from the queue
+   uint32_t *hits ;         // reads of each (row1, row2), for relayout() and profile
+   int lastShips, lastDepth ;   // as last passed to listener->finished()
+   int *ldsUsed ;           // per row: the discrepancies on the path to its list
+   int *ldsTaken ;          // and the rows taken from that list so far
+   int ldsLimit, ldsFloor ; // this pass cuts paths past ldsLimit and shows ships from ldsFloor up
+   int ldsCut ;             // this pass cut some path
+   time_t controlAt ;       // when to look at controlFile again
+   std::string controlText ;   // what it held when last applied
+   int tightened ;          // a limit has changed since search() began
+   time_t relayoutAt ;
+   std::vector<unsigned char> qpal ;   // per row of a probe: 1 while all palindromes
+   int qreach ;             // the row a probe got to
+   int qskip ;              // ships in the first row of a probe already reported
+   unsigned long long qdups, qprunes ;
+   uint32_t qpeak ;
+   int qprobeRows ;
+   int qspan ;              // the rows back from a row that its lookahead and lists read
+   struct {                 // search()'s own state, kept here between step()s
+      uint32_t currRow, longest ;
+      unsigned long long lastLong ;
+      int totalShips, buffFlag, firstasymm, stage ;
+      double ms ;
+      time_t nextReport, stopTime ;
+   } run ;
+   char errbuf[256] ;
+   int userParams[NUM_PARAMS] ;   // as given to init(), for traces
+   FILE *trace ;
+   int traceA ;
+   void traceQuery(int a, int result) ;
+   friend class KernelBench ;
+} ;
+
+RuleTable::RuleTable() {
+   width = symmetry = reorder = built = 0 ;
+   failed = 0 ;
+   threads = std::thread::hardware_concurrency() ;
+   if (threads < 1)
+      threads = 1 ;
+   eager = 0 ;
+   contexts = 1 ;
+   buildTime = 0 ;
+   gInd3 = 0 ;
+   listFp = 0 ;
+   listRow = 0 ;
+   listIndexSize = 0 ;
+   listsMade = listsStored = listLookups = listProbes = 0 ;
+   listMaxProbe = 0 ;
+   listCollisions = 0 ;
+   ev2Rows = 0 ;
+   gcount = 0 ;
+   valorder = 0 ;
+   gWork = 0 ;
+   gScratch = 0 ;
+   bbuf = 0 ;
+   bbuf_left = 0 ;
+   emptyRow = 0 ;
+   memusage = 0 ;
+   sharedName = 0 ;
+   shm = 0 ;
+   compact = 0 ;
+   mapWords = 1 ;
+   fold = 0 ;
+   revRow = 0 ;
+   listBytes = 0 ;
+   listGood = listCompact = 0 ;
+   memlimit = 0x7000000000000000LL ;
+   setRule("B3/S23") ; // pick up default rule
 }
 
-char nttable2[512] ;
+RuleTable::~RuleTable() {
+   for (size_t i=0; i<chunks.size(); i++)
+      free(chunks[i]) ;
+   if (shm) {
+#ifndef _WIN32
+      munmap(shm, shm->size) ;
+#endif
+   } else {
+      free(gInd3) ;
+      free(listFp) ;
+      free(listRow) ;
+      free(ev2Rows) ;
+      free(valorder) ;
+   }
+   free(gcount) ;
+   free(gWork) ;
+   free(gScratch) ;
+   free(emptyRow) ;
+   free(revRow) ;
+}
+
+/*
+ *   Set the rule; this must happen before build().
+ */
+const char *RuleTable::setRule(const char *r) {
+   if (built)
+      return "Can't change the rule of a table that has been built" ;
+   if (strlen(r) >= sizeof(rule))
+      return "Rule string too long" ;
+   const char *err = parseRule(r, nttable) ;
+   if (err)
+      return err ;
+   strcpy(rule, r) ;
+   fasterTable() ;
+   return 0 ;
+}
 
-int slowEvolveBit(int row1, int row2, int row3, int bshift){
+int RuleTable::slowEvolveBit(int row1, int row2, int row3, int bshift){
    return nttable[(((row2>>bshift) & 2)<<7) | (((row1>>bshift) & 2)<<6)
                 | (((row1>>bshift) & 4)<<4) | (((row2>>bshift) & 4)<<3)
                 | (((row3>>bshift) & 7)<<2) | (((row2>>bshift) & 1)<<1)
                 |  ((row1>>bshift) & 1)<<0];
 }
 
-void fasterTable() {
+void RuleTable::fasterTable() {
    int p = 0 ;
    for (int row1=0; row1<8; row1++)
       for (int row2=0; row2<8; row2++)
@@ -193,28 +764,28 @@ void fasterTable() {
             nttable2[p++] = slowEvolveBit(row1, row2, row3, 0) ;
 }
 
-int evolveBit(int row1, int row2, int row3, int bshift) {
+int RuleTable::evolveBit(int row1, int row2, int row3, int bshift) {
    return nttable2[
       (((row1 << 6) >> bshift) & 0700) +
       (((row2 << 3) >> bshift) &  070) +
       (( row3       >> bshift) &   07)] ;
 }
 
-int evolveBit(int row1, int row2, int row3) {
+int RuleTable::evolveBit(int row1, int row2, int row3) {
    return nttable2[
       ((row1 << 6) & 0700) +
       ((row2 << 3) &  070) +
       ( row3       &   07)] ;
 }
 
-int evolveRow(int row1, int row2, int row3){
+int RuleTable::evolveRow(int row1, int row2, int row3){
    int row4;
    int row1_s,row2_s,row3_s;
    int j,s = 0;
-   if(sp[P_SYMMETRY] == SYM_ODD) s = 1;
+   if(symmetry == SYM_ODD) s = 1;
    if(evolveBit(row1, row2, row3, width - 1)) return -1;
-   if(sp[P_SYMMETRY] == SYM_ASYM && evolveBit(row1 << 2, row2 << 2, row3 << 2)) return -1;
-   if(sp[P_SYMMETRY] == SYM_ODD || sp[P_SYMMETRY] == SYM_EVEN){
+   if(symmetry == SYM_ASYM && evolveBit(row1 << 2, row2 << 2, row3 << 2)) return -1;
+   if(symmetry == SYM_ODD || symmetry == SYM_EVEN){
       row1_s = (row1 << 1) + ((row1 >> s) & 1);
       row2_s = (row2 << 1) + ((row2 >> s) & 1);
       row3_s = (row3 << 1) + ((row3 >> s) & 1);
@@ -228,24 +799,20 @@ int evolveRow(int row1, int row2, int row3){
    for(j = 1; j < width; j++)row4 += evolveBit(row1, row2, row3, j - 1) << j;
    return row4;
 }
-int evolveRowHigh(int row1, int row2, int row3, int bits){
+int RuleTable::evolveRowHigh(int row1, int row2, int row3, int bits){
    int row4=0;
-   int row1_s,row2_s,row3_s;
    int j ;
    if(evolveBit(row1, row2, row3, width - 1)) return -1;
-   row1_s = (row1 << 1);
-   row2_s = (row2 << 1);
-   row3_s = (row3 << 1);
    for(j = width-bits; j < width; j++)row4 += evolveBit(row1, row2, row3, j - 1) << j;
    return row4;
 }
-int evolveRowLow(int row1, int row2, int row3, int bits){
+int RuleTable::evolveRowLow(int row1, int row2, int row3, int bits){
    int row4;
    int row1_s,row2_s,row3_s;
    int j,s = 0;
-   if(sp[P_SYMMETRY] == SYM_ODD) s = 1;
-   if(sp[P_SYMMETRY] == SYM_ASYM && evolveBit(row1 << 2, row2 << 2, row3 << 2)) return -1;
-   if(sp[P_SYMMETRY] == SYM_ODD || sp[P_SYMMETRY] == SYM_EVEN){
+   if(symmetry == SYM_ODD) s = 1;
+   if(symmetry == SYM_ASYM && evolveBit(row1 << 2, row2 << 2, row3 << 2)) return -1;
+   if(symmetry == SYM_ODD || symmetry == SYM_EVEN){
       row1_s = (row1 << 1) + ((row1 >> s) & 1);
       row2_s = (row2 << 1) + ((row2 >> s) & 1);
       row3_s = (row3 << 1) + ((row3 >> s) & 1);
@@ -260,244 +827,1540 @@ int evolveRowLow(int row1, int row2, int row3, int bits){
    return row4;
 }
 
-void sortRows(uint16_t *row, uint32_t totalRows) {
-   uint32_t i;
-   int64_t j;
-   uint16_t t;
-   for(i = 1; i < totalRows; ++i){
-      t = row[i];
-      j = i - 1;
-      while(j >= 0 && gcount[row[j]] < gcount[t]){
-         row[j+1] = row[j];
-         --j;
-      }
-      row[j+1] = t;
-   }
-}
-uint16_t *makeRow(int row1, int row2) ;
-uint16_t *getoffset(int row12) {
-   uint16_t *r = gInd3[row12] ;
-   if (r == 0)
-      r = makeRow(row12 >> width, row12 & ((1 << width) - 1)) ;
-   return r ;
+void RuleTable::sortRows(row_t *row, uint32_t totalRows) {
+   // stable, so rows with equal counts keep their naive order
+   std::stable_sort(row, row + totalRows, [this](row_t a, row_t b) {
+      return gcount[a] > gcount[b] ;
+   }) ;
 }
-uint16_t *getoffset(int row1, int row2) {
-   return getoffset((row1 << width) + row2) ;
-}
-void getoffsetcount(int row1, int row2, int row3, uint16_t* &p, int &n) {
-   uint16_t *row = getoffset(row1, row2) ;
-   p = row + row[row3] ;
-   n = row[row3+1] - row[row3] ;
-}
-int getcount(int row1, int row2, int row3) {
-   uint16_t *row = getoffset(row1, row2) ;
-   return row[row3+1] - row[row3] ;
-}
-int *gWork ;
-int *rowHash ;
-uint16_t *valorder ;
-void genStatCounts() ;
-void makeTables() {
-   gInd3 = (uint16_t **)calloc(sizeof(*gInd3),(1LL<<(width*2))) ;
-   rowHash = (int *)calloc(sizeof(int),(2LL<<(width*2))) ;
+
+/*
+ *   Allocate the tables for the given width, symmetry and search order.
+ *   Building an already built table is fine as long as the parameters
+ *   match; that is how Searchers share a table.
+ */
+const char *RuleTable::build(int w, int sym, int reord) {
+   if (built) {
+      if (w != width || sym != symmetry || reord != reorder)
+         return "Rule table was built for a different width, symmetry or search order" ;
+      return 0 ;
+   }
+   double starttime = get_wall_time() ;
+   width = w ;
+   symmetry = sym ;
+   reorder = reord ;
+   built = 1 ;
+   if (reorder != 4 || contexts < 1)
+      contexts = 1 ;
+   if (contexts > width + 1)
+      contexts = width + 1 ;
+   mapWords = width > 6 ? 1 << (width - 6) : 1 ;
+   setupFold() ;
+   gWork = (int *)calloc(sizeof(int), 3LL << width) ;
+   // room for the longest list, 2^width rows in either layout
+   gScratch = (row_t *)calloc(sizeof(row_t), (3LL << width) + 64) ;
+   emptyRow = (row_t *)calloc(sizeof(row_t), 1+(1<<width)+listSize(0, gWork)) ;
+   if (sharedName) {
+      const char *err = openShared() ;
+      if (err) {
+         failed = err ;
+         return err ;
+      }
+      if (shm->ready) {
+         buildTime = get_wall_time() - starttime ;
+         return 0 ;
+      }
+   }
+   gInd3 = (row_t **)tableAlloc(sizeof(*gInd3) << (width*2)) ;
    for (int i=0; i<1<<(2*width); i++)
       gInd3[i] = 0 ;
-   for (int i=0; i<2<<(2*width); i++)
-      rowHash[i] = -1 ;
-   ev2Rows = (uint16_t *)calloc(sizeof(*ev2Rows), (1LL << (width * 2)));
+   listIndexSize = 2048 ;
+   while (listIndexSize < (2LL << width))
+      listIndexSize <<= 1 ;
+   if (shm) {
+      // the index can't grow in place, so it is sized for as many lists
+      // as could fit: all of them, or as many of the smallest as the
+      // segment holds
+      long long most = shm->size / (sizeof(row_t) * listSize(0, gWork)) ;
+      if (most > 1LL << (2 * width))
+         most = 1LL << (2 * width) ;
+      while (3 * listIndexSize < 4 * most)
+         listIndexSize <<= 1 ;
+   }
+   listFp = (uint64_t *)tableAlloc(sizeof(*listFp) * listIndexSize) ;
+   listRow = (uint32_t *)tableAlloc(sizeof(*listRow) * listIndexSize) ;
+   ev2Rows = (row_t *)tableAlloc(sizeof(*ev2Rows) << (width * 2)) ;
    gcount = (uint32_t *)calloc(sizeof(*gcount), (1LL << width));
-   memusage += (sizeof(*gInd3)+sizeof(*ev2Rows)+2*sizeof(int)) << (width*2) ;
+   memusage += (sizeof(*gInd3)+sizeof(*ev2Rows)) << (width*2) ;
+   memusage += (sizeof(*listFp) + sizeof(*listRow)) * listIndexSize ;
    uint32_t i;
-   for(i = 0; i < 1 << width; ++i) gcount[i] = 0 ;
+   for(i = 0; i < 1U << width; ++i) gcount[i] = 0 ;
    for (int i=0; i<1<<(2*width); i++)
       ev2Rows[i] = 0 ;
-   gWork = (int *)calloc(sizeof(int), 3LL << width) ;
-   if (sp[P_REORDER] == 1)
+   if (reorder == 1 || reorder == 4)
       genStatCounts() ;
-   if (sp[P_REORDER] == 2) {
+   if (reorder == 2) {
       std::mt19937 mt_rand(time(0));
       for (int i=1; i<1<<width; i++)
          gcount[i] = 1 + (mt_rand() & 0x3fffffff) ;
    }
-   if (sp[P_REORDER] == 3)
+   if (reorder == 3)
       for (int i=1; i<1<<width; i++)
          gcount[i] = 1 + gcount[i & (i - 1)] ;
    gcount[0] = 0 ;
-   valorder = (uint16_t *)calloc(sizeof(uint16_t), 1LL << width) ;
+   valorder = (row_t *)tableAlloc(sizeof(row_t) * ((long long)contexts << width)) ;
    for (int i=0; i<1<<width; i++)
       valorder[i] = (1<<width)-1-i ;
-   if (sp[P_REORDER] != 0)
+   if (reorder != 0)
       sortRows(valorder, 1<<width) ;
-   for (int row2=0; row2<1<<width; row2++)
-      makeRow(0, row2) ;
+   if (reorder == 4)
+      genContextOrders() ;
+   buildLists(eager ? 1 << (2 * width) : 1 << width) ;
+   if (shm) {
+      shm->gInd3 = gInd3 ;
+      shm->ev2Rows = ev2Rows ;
+      shm->valorder = valorder ;
+      shm->listFp = listFp ;
+      shm->listRow = listRow ;
+      shm->listIndexSize = listIndexSize ;
+      shm->ready = !failed ;
+#ifndef _WIN32
+      // a table that couldn't be built is no use to anyone else
+      if (failed)
+         shm_unlink(sharedName) ;
+#endif
+      unlockShared() ;
+   } else if (eager && !failed) {
+      // every list is built, so nothing will be looked up again
+      memusage -= (sizeof(*listFp) + sizeof(*listRow)) * listIndexSize ;
+      free(listFp) ;
+      free(listRow) ;
+      listFp = 0 ;
+      listRow = 0 ;
+   }
+   buildTime = get_wall_time() - starttime ;
+   return failed ;
+}
+/*
+ *   Whether the table can be folded (see fold), and the mirror of each
+ *   row for when it is.
+ */
+void RuleTable::setupFold() {
+   // the symmetric modes treat the two edges differently, and a rule
+   // that isn't symmetric itself evolves mirror images differently
+   if (symmetry != SYM_ASYM)
+      fold = 0 ;
+   for (int i=0; i<512; i++) {
+      int m = 0 ;
+      for (int j=0; j<9; j++)
+         m |= ((i >> j) & 1) << (j / 3 * 3 + 2 - j % 3) ;
+      if (nttable2[i] != nttable2[m])
+         fold = 0 ;
+   }
+   free(revRow) ;
+   revRow = (row_t *)calloc(sizeof(row_t), 1LL << width) ;
+   for (int i=0; i<1<<width; i++)
+      for (int j=0; j<width; j++)
+         revRow[i] |= ((i >> j) & 1) << (width - 1 - j) ;
+}
+
+/*
+ *   Predict the memory a table for this width and symmetry will need,
+ *   without allocating it.  The dense index is exact.  The arena is
+ *   estimated by building the lists for a random sample of (row1, row2)
+ *   pairs and counting how many distinct ones turn up; the number of
+ *   distinct lists in the whole table is extrapolated with the Chao1
+ *   estimator, which errs low (by 15-20% at w9 and w10).  This is what
+ *   an eager build would use; a lazy search usually touches only part
+ *   of it.
+ */
+const char *RuleTable::plan(int w, int sym, TablePlan &tp) {
+   if (built)
+      return "Can't plan a table that has already been built" ;
+   width = w ;
+   symmetry = sym ;
+   mapWords = width > 6 ? 1 << (width - 6) : 1 ;
+   setupFold() ;
+   long long pairs = 1LL << (2 * width) ;
+   tp.indexBytes = (sizeof(*gInd3)+sizeof(*ev2Rows)) * pairs +
+                   ((long long)sizeof(*gcount) << width) ;
+   // about 2^27 cells of work, but never fewer than 4096 samples
+   tp.samples = width < 11 ? 1 << 16 : width < 15 ? 1 << (27 - width) : 1 << 12 ;
+   if (tp.samples > pairs)
+      tp.samples = (int)pairs ;
+   tp.exact = tp.samples == pairs ;
+   // list contents don't depend on the order, so the naive one will do
+   valorder = (row_t *)calloc(sizeof(row_t), 1LL << width) ;
+   for (int i=0; i<1<<width; i++)
+      valorder[i] = (1<<width)-1-i ;
+   int *work = (int *)calloc(sizeof(int), 3LL << width) ;
+   std::unordered_map<unsigned long long, int> seen ;
+   std::mt19937 mt_rand(1) ;
+   double totalLen = 0 ;
+   for (int i=0; i<tp.samples; i++) {
+      int row12 = tp.exact ? i : (int)(mt_rand() & (pairs - 1)) ;
+      if (mirrored(row12 >> width, row12 & ((1 << width) - 1)))
+         row12 = (revRow[row12 >> width] << width) + revRow[row12 & ((1 << width) - 1)] ;
+      uint64_t fp ;
+      int good = evolveList(row12 >> width, row12 & ((1 << width) - 1), work, fp) ;
+      if (good < 0)
+         good = 1 << width ;
+      if (seen[fp]++ == 0)
+         totalLen += listSize(good, work) ;
+   }
+   long long f1 = 0, f2 = 0 ;
+   for (auto &e : seen)
+      if (e.second == 1)
+         f1++ ;
+      else if (e.second == 2)
+         f2++ ;
+   tp.avgLen = totalLen / seen.size() ;
+   tp.lists = seen.size() ;
+   if (!tp.exact)
+      tp.lists += f1 * (f1 - 1) / (2 * (f2 + 1)) ;
+   if (tp.lists > pairs)
+      tp.lists = pairs ;
+   // the arena grows a whole chunk at a time
+   long long chunk = (long long)sizeof(row_t) << (2 * width) ;
+   tp.arenaBytes = (long long)(tp.lists * tp.avgLen * sizeof(row_t)) ;
+   tp.arenaBytes = (tp.arenaBytes + chunk - 1) / chunk * chunk ;
+   // the dedup index stays at most 3/4 full, and goes once an eager
+   // build is done
+   long long slots = 2048 ;
+   while (3 * slots < 4 * tp.lists)
+      slots <<= 1 ;
+   tp.indexBytes += slots * (long long)(sizeof(*listFp) + sizeof(*listRow)) ;
+   free(work) ;
+   free(valorder) ;
+   valorder = 0 ;
+   return 0 ;
 }
-uint16_t *bbuf ;
-int bbuf_left = 0 ;
 // reduce fragmentation by allocating chunks larger than needed and
 // parceling out the small pieces.
-uint16_t *bmalloc(int siz) {
+row_t *RuleTable::bmalloc(int siz) {
+   if (shm) {
+      long long bytes = ((long long)siz * sizeof(row_t) + 7) & ~7LL ;
+      if (shm->used + bytes > shm->size) {
+         failed = "Aborting: the shared table is full (create it with a larger R)" ;
+         return 0 ;
+      }
+      row_t *r = (row_t *)((char *)shm + shm->used) ;
+      shm->used += bytes ;
+      return r ;
+   }
    if (siz > bbuf_left) {
-      bbuf_left = 1 << (2 * width) ;
-      memusage += 2*bbuf_left ;
-      if (memusage > memlimit) {
-         printf("Aborting due to excessive memory usage\n") ;
-         exit(0) ;
+      if (memusage + ((long long)sizeof(row_t) << (2 * width)) > memlimit) {
+         failed = "Aborting due to excessive memory usage" ;
+         return 0 ;
       }
-      bbuf = (uint16_t *)calloc(sizeof(uint16_t), bbuf_left) ;
+      bbuf_left = 1 << (2 * width) ;
+      memusage += (long long)sizeof(row_t)*bbuf_left ;
+      bbuf = (row_t *)calloc(sizeof(row_t), bbuf_left) ;
+      chunks.push_back(bbuf) ;
+      chunkUsed.push_back(0) ;
+      chunkBytes.push_back((long long)sizeof(row_t) * bbuf_left) ;
    }
-   uint16_t *r = bbuf ;
+   row_t *r = bbuf ;
    bbuf += siz ;
    bbuf_left -= siz ;
+   chunkUsed.back() += siz * sizeof(row_t) ;
    return r ;
 }
-void unbmalloc(int siz) {
+void RuleTable::unbmalloc(int siz) {
    bbuf -= siz ;
    bbuf_left += siz ;
+   chunkUsed.back() -= siz * sizeof(row_t) ;
 }
-unsigned int hashRow(uint16_t *row, int siz) {
-   unsigned int h = 0 ;
-   for (int i=0; i<siz; i++)
-      h = h * 3 + row[i] ;
-   return h ;
+/*
+ *   Zeroed memory for one of the big tables: from the shared segment if
+ *   there is one (ftruncate() zeroed it), otherwise from the heap.
+ */
+void *RuleTable::tableAlloc(long long bytes) {
+   if (shm == 0)
+      return calloc(1, bytes) ;
+   void *r = (char *)shm + shm->used ;
+   shm->used += (bytes + 63) & ~63LL ;
+   return r ;
 }
-uint16_t *makeRow(int row1, int row2) {
+#ifndef SHAREDADDR
+#define SHAREDADDR 0x200000000000ULL   // well clear of where Linux puts the heap, stacks and libraries
+#endif
+/*
+ *   Create the shared table named sharedName, or attach to it if another
+ *   process already has.  The creator sizes the segment to the R limit
+ *   (half the machine's memory without one; pages are only used as they
+ *   are touched), maps it, and returns with the lock held so build() can
+ *   fill it in; build() publishes it and lets go.  Anyone else waits on
+ *   the lock until it is built, checks it was built for the same rule,
+ *   width, symmetry, order and layout, and takes its pointers.  Segments
+ *   outlive the processes; remove one with rm /dev/shm/NAME (on Linux).
+ */
+const char *RuleTable::openShared() {
+#ifdef _WIN32
+   return "Shared tables need POSIX shared memory" ;
+#else
+   int fd = shm_open(sharedName, O_RDWR | O_CREAT | O_EXCL, 0600) ;
+   int creator = fd >= 0 ;
+   if (!creator)
+      fd = shm_open(sharedName, O_RDWR, 0) ;
+   if (fd < 0)
+      return "Could not open the shared table" ;
+   long long size ;
+   void *want = (void *)SHAREDADDR ;
+   if (creator) {
+      size = memlimit ;
+      if (size >= 0x7000000000000000LL)
+         size = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2 ;
+      if (ftruncate(fd, size) != 0) {
+         close(fd) ;
+         shm_unlink(sharedName) ;
+         return "Could not size the shared table" ;
+      }
+   } else {
+      // wait for the creator to size the segment and set up the lock
+      SharedTable *h = 0 ;
+      for (int tries=0; ; tries++) {
+         struct stat st ;
+         if (h == 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SharedTable)) {
+            h = (SharedTable *)mmap(0, sizeof(SharedTable), PROT_READ, MAP_SHARED, fd, 0) ;
+            if (h == MAP_FAILED)
+               h = 0 ;
+         }
+         if (h && !strcmp((const char *)h->magic, SHAREDMAGIC))
+            break ;
+         if (tries == 3000) {
+            close(fd) ;
+            return "The shared table was never set up; remove it and start again" ;
+         }
+         usleep(10000) ;
+      }
+      want = h->base ;
+      size = h->size ;
+      munmap(h, sizeof(SharedTable)) ;
+   }
+   void *base = mmap(want, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+   if (base != MAP_FAILED && base != want && !creator) {
+      munmap(base, size) ;
+      base = MAP_FAILED ;
+   }
+   if (base == MAP_FAILED && creator)
+      base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) ;
+   close(fd) ;
+   if (base == MAP_FAILED) {
+      if (creator)
+         shm_unlink(sharedName) ;
+      return "Could not map the shared table at the address its creator used" ;
+   }
+   shm = (SharedTable *)base ;
+   if (creator) {
+      shm->base = base ;
+      shm->size = size ;
+      shm->used = (sizeof(SharedTable) + 63) & ~63LL ;
+      shm->width = width ;
+      shm->symmetry = symmetry ;
+      shm->reorder = reorder ;
+      shm->contexts = contexts ;
+      shm->compact = compact ;
+      shm->fold = fold ;
+      shm->rowBytes = sizeof(row_t) ;
+      memcpy(shm->nttable2, nttable2, sizeof(nttable2)) ;
+      pthread_mutexattr_t attr ;
+      pthread_mutexattr_init(&attr) ;
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ;
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) ;
+      pthread_mutex_init(&shm->lock, &attr) ;
+      pthread_mutexattr_destroy(&attr) ;
+      lockShared() ;
+      __atomic_thread_fence(__ATOMIC_RELEASE) ;
+      memcpy(shm->magic, SHAREDMAGIC, sizeof(shm->magic)) ;
+      return 0 ;
+   }
+   lockShared() ;
+   const char *err = 0 ;
+   if (!shm->ready)
+      err = "The process building the shared table died; remove it and start again" ;
+   else if (shm->width != width || shm->symmetry != symmetry ||
+            shm->reorder != reorder || shm->contexts != contexts ||
+            shm->compact != compact || shm->fold != fold || shm->rowBytes != (int)sizeof(row_t) ||
+            memcmp(shm->nttable2, nttable2, sizeof(nttable2)))
+      err = "The shared table was built for a different rule, width, symmetry, order or layout" ;
+   unlockShared() ;
+   if (err) {
+      munmap(shm, size) ;
+      shm = 0 ;
+      return err ;
+   }
+   gInd3 = shm->gInd3 ;
+   ev2Rows = shm->ev2Rows ;
+   valorder = shm->valorder ;
+   listFp = shm->listFp ;
+   listRow = shm->listRow ;
+   listIndexSize = shm->listIndexSize ;
+   return 0 ;
+#endif
+}
+/*
+ *   The lock on a shared table; nothing without one.  If a process dies
+ *   holding it, whatever it was building was never published, so the
+ *   table is still consistent and the next process carries on.
+ */
+void RuleTable::lockShared() {
+#ifndef _WIN32
+   if (shm && pthread_mutex_lock(&shm->lock) == EOWNERDEAD)
+      pthread_mutex_consistent(&shm->lock) ;
+#endif
+}
+void RuleTable::unlockShared() {
+#ifndef _WIN32
+   if (shm)
+      pthread_mutex_unlock(&shm->lock) ;
+#endif
+}
+/*
+ *   Compute the successors of (row1, row2): on return work[0..good-1]
+ *   holds the evolved rows and work[2^width..] the matching row3 values,
+ *   in valorder order, and fp a fingerprint of them.  Returns good, or
+ *   -1 if the list can't be stored.  Apart from the ev2Rows entries for
+ *   this row2 nothing shared is written, so this is safe to run on
+ *   several threads at once.
+ */
+int RuleTable::evolveList(int row1, int row2, int *work, uint64_t &fp) {
+   const row_t *order = valorder + (contextOf(row2) << width) ;
    int good = 0 ;
-   int *gWork2 = gWork + (1 << width) ;
-   int *gWork3 = gWork2 + (1 << width) ;
+   int *work2 = work + (1 << width) ;
+   int *work3 = work2 + (1 << width) ;
    if (width < 4) {
       for (int row3=0; row3<1<<width; row3++)
-         gWork3[row3] = evolveRow(row1, row2, row3) ;
+         work3[row3] = evolveRow(row1, row2, row3) ;
    } else {
       int lowbitcount = (width >> 1) + 1 ;
       int hibitcount = ((width + 1) >> 1) + 1 ;
       int hishift = lowbitcount - 2 ;
       int lowcount = 1 << lowbitcount ;
       for (int row3=0; row3<1<<lowbitcount; row3++)
-         gWork2[row3] = evolveRowLow(row1, row2, row3, lowbitcount-1) ;
+         work2[row3] = evolveRowLow(row1, row2, row3, lowbitcount-1) ;
       for (int row3=0; row3<1<<width; row3 += 1<<hishift)
-         gWork2[lowcount+(row3>>hishift)] =
+         work2[lowcount+(row3>>hishift)] =
                         evolveRowHigh(row1, row2, row3, hibitcount-1) ;
       for (int row3=0; row3<1<<width; row3++)
-         gWork3[row3] = gWork2[row3 & ((1<<lowbitcount) - 1)] |
-                        gWork2[lowcount+(row3 >> hishift)] ;
+         work3[row3] = work2[row3 & ((1<<lowbitcount) - 1)] |
+                       work2[lowcount+(row3 >> hishift)] ;
    }
    for (int row3i = 0; row3i < 1<<width; row3i++) {
-      int row3 = valorder[row3i] ;
+      int row3 = order[row3i] ;
       int row23 = (row2 << width) + row3 ;
-      int row4 = gWork3[row3] ;
+      int row4 = work3[row3] ;
       if (row4 < 0)
          continue ;
-      if (row1 == 0)
+      if (row1 == 0 && ev2Rows) {
          ev2Rows[row23] = row4 ;
-      gWork2[good] = row3 ;
-      gWork[good++] = row4 ;
+         if (fold)     // for the mirror image, whose list is never evolved
+            ev2Rows[(revRow[row2] << width) + revRow[row3]] = revRow[row4] ;
+      }
+      work2[good] = row3 ;
+      work[good++] = row4 ;
+   }
+   // the pairs in this order determine the list, so they identify it
+   uint64_t h = 0x9e3779b97f4a7c15ULL ;
+   for (int i=0; i<good; i++) {
+      h = (h ^ (((uint64_t)work[i] << 32) | work2[i])) * 0xff51afd7ed558ccdULL ;
+      h ^= h >> 32 ;
+   }
+   h ^= (uint64_t)good ;
+   h ^= h >> 33 ;
+   h *= 0xc4ceb9fe1a85ec53ULL ;
+   fp = h ^ (h >> 33) ;
+   if (fp == 0)           // reserved for empty index slots
+      fp = 1 ;
+   // a row_t can't count to 2^MAXROWBITS, so all of them in one bucket
+   // would read back as none
+   if (width == MAXROWBITS && good == 1 << width) {
+      int row3 = 1 ;
+      while (row3 < good && work[row3] == work[0])
+         row3++ ;
+      if (row3 == good)
+         return -1 ;
+   }
+   return good ;
+}
+/*
+ *   The row_t entries the list computed by evolveList() needs.  The
+ *   compact layout depends on how many buckets are used, so the size of
+ *   each is counted into the last third of work, where fillList() picks
+ *   it up; its lists are kept to whole uint64_t so the bitmaps stay
+ *   aligned.
+ */
+int RuleTable::listSize(int good, int *work) {
+   if (!compact)
+      return 1 + (1 << width) + good ;
+   int *used = work + 2 * (1 << width) ;
+   for (int row4=0; row4 < 1<<width; row4++)
+      used[row4] = 0 ;
+   for (int i=0; i<good; i++)
+      used[work[i]]++ ;
+   int buckets = 0 ;
+   for (int row4=0; row4 < 1<<width; row4++)
+      buckets += used[row4] != 0 ;
+   return compactSize(buckets, good) ;
+}
+// the compact layout of a list with rows in this many buckets
+int RuleTable::compactSize(int buckets, int good) {
+   int align = sizeof(uint64_t) / sizeof(row_t) ;
+   int siz = mapWords * align + mapWords + 1 + (buckets ? buckets : 1) + 1 + good ;
+   return (siz + align - 1) / align * align ;
+}
+/*
+ *   Add a list just stored to the totals that give the size of the
+ *   other layout: the dense one needs 1+2^width offsets and the rows,
+ *   the compact one depends on how many buckets have rows.
+ */
+void RuleTable::countList(const row_t *row, int good) {
+   int buckets = 0 ;
+   if (compact) {
+      for (int i=0; i<mapWords; i++)
+         buckets += __builtin_popcountll(((const uint64_t *)row)[i]) ;
+   } else {
+      for (int row4=0; row4 < 1<<width; row4++)
+         buckets += row[row4+1] != row[row4] ;
+   }
+   listGood += good ;
+   listCompact += compactSize(buckets, good) ;
+}
+/*
+ *   The size listSize() gave a list, read back from the list, or -1 if
+ *   its count of rows could have wrapped around (at w16, or w8 with
+ *   NARROW) and so can't be trusted.
+ */
+int RuleTable::storedSize(const row_t *row) {
+   int good = storedGood(row) ;
+   if (good < 0)
+      return -1 ;
+   if (!compact)
+      return 1 + (1 << width) + good ;
+   int align = sizeof(uint64_t) / sizeof(row_t) ;
+   return compactSize((row_t)(row[mapWords * align + mapWords] + 1), good) ;
+}
+// and the number of rows in it (evolveList()'s good), likewise
+int RuleTable::storedGood(const row_t *row) {
+   if (width >= 8 * (int)sizeof(row_t))
+      return -1 ;
+   if (!compact)
+      return row[1 << width] ;
+   int align = sizeof(uint64_t) / sizeof(row_t) ;
+   const row_t *offs = row + mapWords * align + mapWords + 1 ;
+   return offs[(row_t)(row[mapWords * align + mapWords] + 1)] ;
+}
+/*
+ *   Lay out the list computed by evolveList() at row: 1+2^width offsets
+ *   followed by the good row3 values, grouped by evolved row, or the
+ *   compact equivalent, which needs the bucket sizes listSize() left in
+ *   work.
+ */
+void RuleTable::fillList(row_t *row, int good, int *work) {
+   const int *work2 = work + (1 << width) ;
+   if (compact) {
+      // turn the bucket sizes into where each bucket starts
+      int *start = work + 2 * (1 << width) ;
+      uint64_t *map = (uint64_t *)row ;
+      row_t *rank = row + mapWords * (sizeof(uint64_t) / sizeof(row_t)) ;
+      row_t *offs = rank + mapWords + 1 ;
+      int buckets = 0, pos = 0 ;
+      for (int i=0; i<mapWords; i++) {
+         uint64_t bits = 0 ;
+         rank[i] = buckets ;
+         for (int j=0; j<64 && (i<<6)+j < 1<<width; j++) {
+            int row4 = (i << 6) + j ;
+            int n = start[row4] ;
+            bits |= (uint64_t)(n != 0) << j ;
+            offs[buckets] = pos ;
+            buckets += n != 0 ;
+            start[row4] = pos ;
+            pos += n ;
+         }
+         map[i] = bits ;
+      }
+      rank[mapWords] = buckets - 1 ;
+      offs[buckets] = pos ;
+      row_t *vals = offs + buckets + 1 ;
+      for (int i=0; i<good; i++)
+         vals[start[work[i]]++] = work2[i] ;
+      return ;
    }
-   uint16_t *row = bmalloc((1+(1<<width)+good)) ;
+   row_t *vals = row + 1 + (1 << width) ;
    for (int row3=0; row3 < 1<<width; row3++)
       row[row3] = 0 ;
-   row[0] = 1 + (1 << width) ;
    for (int row3=0; row3 < good; row3++)
-      row[gWork[row3]]++ ;
+      row[work[row3]]++ ;
    row[1<<width] = 0 ;
    for (int row3=0; row3 < (1<<width); row3++)
       row[row3+1] += row[row3] ;
    for (int row3=good-1; row3>=0; row3--) {
-      int row4 = gWork[row3] ;
-      row[--row[row4]] = gWork2[row3] ;
-   }
-   unsigned int h = hashRow(row, 1+(1<<width)+good) ;
-   h &= (2 << (2 * width)) - 1 ;
-   while (1) {
-      if (rowHash[h] == -1) {
-         rowHash[h] = (row1 << width) + row2 ;
-         break ;
+      int row4 = work[row3] ;
+      vals[--row[row4]] = work2[row3] ;
+   }
+}
+/*
+ *   Whether the stored list at row is the one evolveList() left in
+ *   work, by laying that out in scratch and comparing.  This uses up
+ *   the bucket sizes listSize() leaves in work, so call listSize()
+ *   again before laying the list out anywhere else.
+ */
+int RuleTable::sameList(const row_t *row, int good, int *work, row_t *scratch) {
+   int stored = storedGood(row) ;
+   if (stored >= 0 && stored != good)
+      return 0 ;
+   listSize(good, work) ;
+   int n = 1 + (1 << width) + good ;
+   if (compact) {
+      const int *used = work + 2 * (1 << width) ;
+      int buckets = 0 ;
+      for (int row4=0; row4 < 1<<width; row4++)
+         buckets += used[row4] != 0 ;
+      n = mapWords * (sizeof(uint64_t) / sizeof(row_t)) + mapWords + 1 + buckets + 1 + good ;
+   }
+   fillList(scratch, good, work) ;
+   return memcmp(row, scratch, n * sizeof(row_t)) == 0 ;
+}
+/*
+ *   Look for a list with this fingerprint among those already built.
+ *   If there is none, 0 is returned and slot is left at the free slot
+ *   for it.  A match is only a candidate: two different lists can
+ *   share a fingerprint, so callers check it with sameList().
+ */
+row_t *RuleTable::findList(uint64_t fp, long long &slot) {
+   if (listFp == 0)
+      return 0 ;
+   long long mask = listIndexSize - 1 ;
+   int probes = 1 ;
+   slot = (long long)(fp & mask) ;
+   listLookups++ ;
+   while (listFp[slot] != 0 && listFp[slot] != fp) {
+      slot = (slot + 1) & mask ;
+      probes++ ;
+   }
+   listProbes += probes ;
+   if (probes > listMaxProbe)
+      listMaxProbe = probes ;
+   return listFp[slot] ? gInd3[listRow[slot]] : 0 ;
+}
+/*
+ *   Record a new list in the slot findList() left free, doubling the
+ *   index first if that would make it more than 3/4 full.
+ */
+void RuleTable::addList(long long slot, uint64_t fp, int row12) {
+   listsStored++ ;
+   if (listFp == 0)
+      return ;
+   if (shm) {
+      // full: the list is kept, but later copies of it won't be found
+      if (4 * (shm->listIndexUsed + 1) > 3 * listIndexSize)
+         return ;
+      shm->listIndexUsed++ ;
+   } else if (4 * listsStored > 3 * listIndexSize) {
+      long long oldSize = listIndexSize ;
+      uint64_t *oldFp = listFp ;
+      uint32_t *oldRow = listRow ;
+      listIndexSize *= 2 ;
+      long long mask = listIndexSize - 1 ;
+      listFp = (uint64_t *)calloc(sizeof(*listFp), listIndexSize) ;
+      listRow = (uint32_t *)calloc(sizeof(*listRow), listIndexSize) ;
+      for (long long i=0; i<oldSize; i++)
+         if (oldFp[i]) {
+            long long j = (long long)(oldFp[i] & mask) ;
+            while (listFp[j])
+               j = (j + 1) & mask ;
+            listFp[j] = oldFp[i] ;
+            listRow[j] = oldRow[i] ;
+         }
+      free(oldFp) ;
+      free(oldRow) ;
+      memusage += (sizeof(*listFp) + sizeof(*listRow)) * oldSize ;
+      slot = (long long)(fp & mask) ;
+      while (listFp[slot])
+         slot = (slot + 1) & mask ;
+   }
+   listFp[slot] = fp ;
+   listRow[slot] = row12 ;
+}
+// what the lists stored so far would take in the layout not in use
+long long RuleTable::otherLayoutBytes() {
+   if (compact)
+      return (long long)sizeof(row_t) * (listsStored * (1 + (1 << width)) + listGood) ;
+   return (long long)sizeof(row_t) * listCompact ;
+}
+const char *RuleTable::listStats(char *buf) {
+   sprintf(buf, "%lld lists, %lld distinct (%.1fx), %.2f probes per lookup, longest %d; %.1f MB in %s lists",
+           listsMade, listsStored, listsStored ? (double)listsMade / listsStored : 0.0,
+           listLookups ? (double)listProbes / listLookups : 0.0, listMaxProbe,
+           listBytes / 1048576.0, compact ? "compact" : "dense") ;
+   if (fold)
+      strcat(buf, ", folded") ;
+   if (listCollisions)
+      sprintf(buf + strlen(buf), "; %lld fingerprints shared by different lists", listCollisions) ;
+   if (shm)
+      sprintf(buf + strlen(buf), "; shared table %.1f of %.1f MB used",
+              shm->used / 1048576.0, shm->size / 1048576.0) ;
+   return buf ;
+}
+/*
+ *   Move every list into one new block, the most read first, so the
+ *   ones a search keeps going back to share pages rather than lying
+ *   wherever they were first needed; hits counts the reads of each
+ *   (row1, row2) pair.  The dedup index and gcount are only needed
+ *   while building and are freed, so lists built after this aren't
+ *   shared with their duplicates.  Any list pointer held elsewhere is
+ *   stale afterwards, so this is only for a table one search is using,
+ *   and never a shared one.  What was done goes in report.
+ */
+const char *RuleTable::relayout(const uint32_t *hits, char *report) {
+   if (shm)
+      return "The lists of a shared table can't be moved" ;
+   if (failed)
+      return failed ;
+   struct moved {
+      row_t *from, *to ;
+      long long size ;
+      uint64_t hits ;
+   } ;
+   std::vector<moved> lists ;
+   std::unordered_map<row_t *, size_t> which ;
+   long long pairs = 1LL << (2 * width) ;
+   for (long long row12=0; row12<pairs; row12++) {
+      row_t *row = gInd3[row12] ;
+      if (row == 0 || row == emptyRow)
+         continue ;
+      auto it = which.find(row) ;
+      if (it == which.end()) {
+         int size = storedSize(row) ;
+         if (size < 0) {
+            // worked out again; the list's own pair comes first (a
+            // mirror image comes before its pair)
+            uint64_t fp ;
+            size = listSize(evolveList(row12 >> width, row12 & ((1 << width) - 1), gWork, fp), gWork) ;
+         }
+         moved m = { row, 0, size, 0 } ;
+         it = which.insert(std::make_pair(row, lists.size())).first ;
+         lists.push_back(m) ;
       }
-      if (memcmp(row, gInd3[rowHash[h]], 2*(1+(1<<width)+good)) == 0) {
-         row = gInd3[rowHash[h]] ;
-         unbmalloc(1+(1<<width)+good) ;
-         break ;
+      lists[it->second].hits += hits[row12] ;
+   }
+   std::sort(lists.begin(), lists.end(), [](const moved &a, const moved &b) {
+      return a.hits != b.hits ? a.hits > b.hits : a.from < b.from ;
+   }) ;
+   long long total = 0 ;
+   uint64_t reads = 0 ;
+   for (size_t i=0; i<lists.size(); i++) {
+      total += lists[i].size ;
+      reads += lists[i].hits ;
+   }
+   long long bytes = total * sizeof(row_t) ;
+   if (memusage + bytes > memlimit)
+      return "Not enough memory left under R to move the lists" ;
+   row_t *block = 0 ;
+#ifdef _WIN32
+   block = (row_t *)malloc(bytes + 1) ;
+#else
+   // on 2 MB pages where the system allows, for fewer TLB misses
+   if (posix_memalign((void **)&block, 1 << 21, bytes + 1))
+      block = 0 ;
+#ifdef MADV_HUGEPAGE
+   if (block)
+      madvise(block, bytes + 1, MADV_HUGEPAGE) ;
+#endif
+#endif
+   if (block == 0)
+      return "Not enough memory to move the lists" ;
+   // the pages the lists making up 90% of the reads were on, and are on
+   std::vector<uintptr_t> pages ;
+   size_t hot = 0 ;
+   for (uint64_t sum=0; hot<lists.size() && 10 * sum < 9 * reads; hot++) {
+      sum += lists[hot].hits ;
+      uintptr_t first = (uintptr_t)lists[hot].from >> 12 ;
+      uintptr_t last = ((uintptr_t)(lists[hot].from + lists[hot].size) - 1) >> 12 ;
+      for (uintptr_t p=first; p<=last; p++)
+         pages.push_back(p) ;
+   }
+   std::sort(pages.begin(), pages.end()) ;
+   long long pagesBefore = std::unique(pages.begin(), pages.end()) - pages.begin() ;
+   // the hot lists keep the order they were built in, which is more or
+   // less the order the search uses them together, and so do the rest
+   std::sort(lists.begin(), lists.begin() + hot, [](const moved &a, const moved &b) {
+      return a.from < b.from ;
+   }) ;
+   std::sort(lists.begin() + hot, lists.end(), [](const moved &a, const moved &b) {
+      return a.from < b.from ;
+   }) ;
+   long long off = 0, hotEnd = 0 ;
+   for (size_t i=0; i<lists.size(); i++) {
+      lists[i].to = block + off ;
+      memcpy(lists[i].to, lists[i].from, lists[i].size * sizeof(row_t)) ;
+      off += lists[i].size ;
+      if (i < hot)
+         hotEnd = off ;
+   }
+   long long pagesAfter = hot ? ((((uintptr_t)(block + hotEnd) - 1) >> 12) - ((uintptr_t)block >> 12) + 1) : 0 ;
+   which.clear() ;
+   for (size_t i=0; i<lists.size(); i++)
+      which[lists[i].from] = i ;
+   for (long long row12=0; row12<pairs; row12++) {
+      row_t *row = gInd3[row12] ;
+      if (row != 0 && row != emptyRow)
+         gInd3[row12] = lists[which[row]].to ;
+   }
+   for (size_t i=0; i<chunks.size(); i++)
+      free(chunks[i]) ;
+   memusage -= (long long)chunks.size() * ((long long)sizeof(row_t) << (2 * width)) ;
+   chunks.clear() ;
+   chunks.push_back(block) ;
+   chunkUsed.assign(1, bytes) ;
+   chunkBytes.assign(1, bytes) ;
+   bbuf = 0 ;
+   bbuf_left = 0 ;
+   memusage += bytes ;
+   if (listFp) {
+      memusage -= (sizeof(*listFp) + sizeof(*listRow)) * listIndexSize ;
+      free(listFp) ;
+      free(listRow) ;
+      listFp = 0 ;
+      listRow = 0 ;
+   }
+   free(gcount) ;
+   gcount = 0 ;
+#ifdef __GLIBC__
+   malloc_trim(0) ;     // the chunks were mostly below the mmap threshold
+#endif
+   sprintf(report, "%lld lists moved into %.1f MB; the %lld read most (90%% of reads) went from %lld pages to %lld",
+           (long long)lists.size(), bytes / 1048576.0, (long long)hot, pagesBefore, pagesAfter) ;
+   return 0 ;
+}
+/*
+ *   Power-of-two histograms for profile(): bucket 0 counts zeros,
+ *   bucket b counts values from 2^(b-1) to 2^b - 1.
+ */
+static int histBucket(unsigned long long v) {
+   return v ? 64 - __builtin_clzll(v) : 0 ;
+}
+static std::string histLine(const char *title, const std::vector<long long> &h) {
+   std::string line = title ;
+   char buf[80] ;
+   for (size_t b=0; b<h.size(); b++) {
+      if (h[b] == 0)
+         continue ;
+      if (b < 2)
+         sprintf(buf, " %d:%lld", (int)b, h[b]) ;
+      else
+         sprintf(buf, " %llu-%llu:%lld", 1ULL << (b - 1), (1ULL << b) - 1, h[b]) ;
+      line += buf ;
+   }
+   return line ;
+}
+/*
+ *   What the table holds and how it is used, one line at a time: how
+ *   much of the 4^width index has lists, how well they deduplicate, how
+ *   long they are, how the reads counted in hits (if any) are spread
+ *   over the entries, with the top most read, and how full the arena's
+ *   chunks are.  Meant for deciding whether a sparse index, another
+ *   layout or a bigger arena would pay for a given search.
+ */
+void RuleTable::profile(const uint32_t *hits, int top, std::vector<std::string> &lines) {
+   char buf[300] ;
+   long long pairs = 1LL << (2 * width) ;
+   long long built = 0, mirror = 0, empty = 0, touched = 0 ;
+   unsigned long long reads = 0 ;
+   struct listUse {
+      int good ;
+      long long size ;
+   } ;
+   std::unordered_map<row_t *, listUse> lists ;
+   std::vector<long long> goodHist(2 + width), sizeHist(40), readHist(34) ;
+   std::vector<uint32_t> heat ;
+   for (long long row12=0; row12<pairs; row12++) {
+      row_t *row = gInd3[row12] ;
+      if (hits && hits[row12]) {
+         touched++ ;
+         reads += hits[row12] ;
+         readHist[histBucket(hits[row12])]++ ;
+         heat.push_back(hits[row12]) ;
+      }
+      if (row == 0)
+         continue ;
+      built++ ;
+      if (row == emptyRow) {
+         empty++ ;
+         continue ;
+      }
+      if (mirrored(row12 >> width, row12 & ((1 << width) - 1)))
+         mirror++ ;
+      if (lists.count(row))
+         continue ;
+      listUse u ;
+      u.good = storedGood(row) ;
+      u.size = storedSize(row) ;
+      if (u.good < 0) {
+         uint64_t fp ;
+         u.good = evolveList(row12 >> width, row12 & ((1 << width) - 1), gWork, fp) ;
+         u.size = listSize(u.good, gWork) ;
+      }
+      lists[row] = u ;
+      goodHist[histBucket(u.good)]++ ;
+      sizeHist[histBucket(u.size * sizeof(row_t))]++ ;
+   }
+   sprintf(buf, "Table profile: %lld of %lld (row1, row2) entries built (%.2f%%), %lld through a mirror image, %lld given the empty list",
+           built, pairs, 100.0 * built / pairs, mirror, empty) ;
+   lines.push_back(buf) ;
+   sprintf(buf, "  lists: %lld made, %lld distinct (%.1fx), %.1f MB in %s lists",
+           listsMade, listsStored, listsStored ? (double)listsMade / listsStored : 0.0,
+           listBytes / 1048576.0, compact ? "compact" : "dense") ;
+   lines.push_back(buf) ;
+   if (listFp) {
+      sprintf(buf, "  dedup index: %lld slots, %.1f%% full, %.2f probes per lookup, longest %d",
+              listIndexSize, 100.0 * (shm ? shm->listIndexUsed : listsStored) / listIndexSize,
+              listLookups ? (double)listProbes / listLookups : 0.0, listMaxProbe) ;
+   } else
+      sprintf(buf, "  dedup index: freed after %lld lookups (%.2f probes per lookup, longest %d)",
+              listLookups, listLookups ? (double)listProbes / listLookups : 0.0, listMaxProbe) ;
+   lines.push_back(buf) ;
+   lines.push_back(histLine("  rows per list:", goodHist)) ;
+   lines.push_back(histLine("  bytes per list:", sizeHist)) ;
+   if (hits) {
+      std::sort(heat.begin(), heat.end(), std::greater<uint32_t>()) ;
+      unsigned long long top1 = 0, top10 = 0 ;
+      for (size_t i=0; i<heat.size(); i++) {
+         if (100 * i < heat.size())
+            top1 += heat[i] ;
+         if (10 * i < heat.size())
+            top10 += heat[i] ;
+      }
+      sprintf(buf, "  reads: %llu, of %lld entries (%.2f%% of the index); the most read 1%% of those take %.1f%%, 10%% take %.1f%%",
+              reads, touched, 100.0 * touched / pairs,
+              reads ? 100.0 * top1 / reads : 0.0, reads ? 100.0 * top10 / reads : 0.0) ;
+      lines.push_back(buf) ;
+      lines.push_back(histLine("  reads per entry read:", readHist)) ;
+      std::vector<long long> order ;
+      for (long long row12=0; row12<pairs; row12++)
+         if (hits[row12])
+            order.push_back(row12) ;
+      if ((long long)order.size() > top) {
+         std::partial_sort(order.begin(), order.begin() + top, order.end(), [&](long long a, long long b) {
+            return hits[a] > hits[b] ;
+         }) ;
+         order.resize(top) ;
+      } else
+         std::sort(order.begin(), order.end(), [&](long long a, long long b) {
+            return hits[a] > hits[b] ;
+         }) ;
+      for (size_t i=0; i<order.size(); i++) {
+         row_t *row = gInd3[order[i]] ;
+         int good = row && row != emptyRow ? lists[row].good : 0 ;
+         sprintf(buf, "  %u reads (%.2f%%) of row1 %lld, row2 %lld: %d rows",
+                 hits[order[i]], 100.0 * hits[order[i]] / reads, order[i] >> width,
+                 order[i] & ((1 << width) - 1), good) ;
+         lines.push_back(buf) ;
+      }
+   }
+   if (shm) {
+      sprintf(buf, "  arena: shared segment, %.1f of %.1f MB used", shm->used / 1048576.0, shm->size / 1048576.0) ;
+      lines.push_back(buf) ;
+      return ;
+   }
+   long long used = 0, unused = 0, least = -1, most = 0 ;
+   for (size_t i=0; i<chunkUsed.size(); i++) {
+      used += chunkUsed[i] ;
+      unused += chunkBytes[i] - chunkUsed[i] ;
+      if (least < 0 || chunkUsed[i] < least)
+         least = chunkUsed[i] ;
+      if (chunkUsed[i] > most)
+         most = chunkUsed[i] ;
+   }
+   sprintf(buf, "  arena: %d chunks, %.1f MB used, %.1f KB not (at chunk ends and in the last)",
+           (int)chunks.size(), used / 1048576.0, unused / 1024.0) ;
+   std::string line = buf ;
+   if (chunks.size() > 16) {
+      sprintf(buf, "; %.1f to %.1f KB used in each", least / 1024.0, most / 1024.0) ;
+      line += buf ;
+   } else
+      for (size_t i=0; i<chunkUsed.size(); i++) {
+         sprintf(buf, "%s%.1f", i ? " " : "; KB used in each: ", chunkUsed[i] / 1024.0) ;
+         line += buf ;
+      }
+   lines.push_back(line) ;
+}
+/*
+ *   Build the list for (row1, row2) on demand.  In a shared table
+ *   another process may have got there first; the list is computed
+ *   before taking the lock so it is held only for the dedup lookup,
+ *   the layout and the publishing.  The list is laid out before its
+ *   gInd3 entry is set, so a reader that sees the entry sees the list.
+ */
+row_t *RuleTable::makeRow(int row1, int row2) {
+   uint64_t fp ;
+   int row12 = (row1 << width) + row2 ;
+   if (mirrored(row1, row2)) {
+      row_t *row = getoffset(revRow[row1], revRow[row2]) ;
+      __atomic_store_n(&gInd3[row12], row, __ATOMIC_RELEASE) ;
+      return row ;
+   }
+   int good = evolveList(row1, row2, gWork, fp) ;
+   if (good < 0) {
+      failed = "Rule has a successor list too long for this row size" ;
+      return emptyRow ;
+   }
+   lockShared() ;
+   row_t *row = gInd3[row12] ;
+   if (row) {
+      unlockShared() ;
+      return row ;
+   }
+   listsMade++ ;
+   long long slot ;
+   row = findList(fp, slot) ;
+   if (row && !sameList(row, good, gWork, gScratch)) {
+      // kept, but outside the index, whose slot is the other list's
+      listCollisions++ ;
+      row = 0 ;
+      slot = -1 ;
+   }
+   if (row == 0) {
+      int siz = listSize(good, gWork) ;
+      row = bmalloc(siz) ;
+      if (row == 0) {
+         unlockShared() ;
+         return emptyRow ;
+      }
+      listBytes += siz * sizeof(row_t) ;
+      fillList(row, good, gWork) ;
+      countList(row, good) ;
+      if (slot >= 0)
+         addList(slot, fp, row12) ;
+      else
+         listsStored++ ;
+   }
+   __atomic_store_n(&gInd3[row12], row, __ATOMIC_RELEASE) ;
+   unlockShared() ;
+/*
+ *   For debugging:
+ *
+   printf("R") ;
+   for (int i=0; i<1+(1<<width)+good; i++)
+      printf(" %d", row[i]) ;
+   printf("\n") ;
+   fflush(stdout) ;
+ */
+   return row ;
+}
+/*
+ *   Build the lists for row12 = 0..n-1 (those not yet built) using all
+ *   the table threads.  Lists and their fingerprints are computed in
+ *   per-thread scratch space.  A new list is laid out under the lock,
+ *   so that one found by its fingerprint is complete, and is compared
+ *   with the duplicate after the lock is gone.
+ */
+void RuleTable::buildLists(int n) {
+   runThreads(threads, [&](int t) {
+      int *work = (int *)calloc(sizeof(int), 3LL << width) ;
+      row_t *scratch = (row_t *)calloc(sizeof(row_t), (3LL << width) + 64) ;
+      for (int row12=t; row12<n; row12 += threads) {
+         if (gInd3[row12] || mirrored(row12 >> width, row12 & ((1 << width) - 1)))
+            continue ;
+         uint64_t fp ;
+         int good = evolveList(row12 >> width, row12 & ((1 << width) - 1), work, fp) ;
+         int siz = good < 0 ? 0 : listSize(good, work) ;
+         row_t *dup = 0 ;
+         {
+            std::lock_guard<std::mutex> lock(tableLock) ;
+            if (failed)
+               break ;
+            if (good < 0) {
+               failed = "Rule has a successor list too long for this row size" ;
+               break ;
+            }
+            listsMade++ ;
+            long long slot ;
+            dup = findList(fp, slot) ;
+            if (dup == 0) {
+               row_t *row = bmalloc(siz) ;
+               if (row == 0)
+                  break ;
+               listBytes += siz * sizeof(row_t) ;
+               fillList(row, good, work) ;
+               countList(row, good) ;
+               addList(slot, fp, row12) ;
+               gInd3[row12] = row ;
+            }
+         }
+         if (dup == 0)
+            continue ;
+         if (sameList(dup, good, work, scratch)) {
+            gInd3[row12] = dup ;
+            continue ;
+         }
+         // kept, but outside the index, whose slot is the other list's
+         siz = listSize(good, work) ;
+         std::lock_guard<std::mutex> lock(tableLock) ;
+         row_t *row = bmalloc(siz) ;
+         if (row == 0)
+            break ;
+         listBytes += siz * sizeof(row_t) ;
+         fillList(row, good, work) ;
+         countList(row, good) ;
+         listsStored++ ;
+         listCollisions++ ;
+         gInd3[row12] = row ;
+      }
+      free(work) ;
+      free(scratch) ;
+   }) ;
+   // a mirror image always comes before its pair in row12 order
+   if (fold && !failed)
+      for (int row12=0; row12<n; row12++)
+         if (gInd3[row12] == 0 && mirrored(row12 >> width, row12 & ((1 << width) - 1)))
+            gInd3[row12] = gInd3[(revRow[row12 >> width] << width) + revRow[row12 & ((1 << width) - 1)]] ;
+}
+
+/*
+ *   We calculate the stats using a 2 * 64 << width array.  We use a
+ *   leading 1 to separate them.  Index 1 aaa bb cc dd represents
+ *   the count for a result of aaa when the last two bits of row1, row2,
+ *   and row3 were bb, cc, and dd, respectively.  We have to manage
+ *   the edge conditions appropriately.
+ */
+/*
+ *   Search order 4: reweight the gcount order by how many different rows
+ *   each candidate can evolve to under the row above it, which is how
+ *   likely the next row down is to find a nonempty bucket.  The count is
+ *   averaged over a sample of row2 values in each population class, and
+ *   candidates with a low gcount and many successors are tried first.
+ *   Split by class (contexts > 1) this was worse on our reference
+ *   searches than a single order for all rows; conditioning on the phase
+ *   as well would need a copy of every list per phase, so is not done.
+ */
+void RuleTable::genContextOrders() {
+   int rows = 1 << width ;
+   std::vector<std::vector<int> > byContext(contexts) ;
+   for (int row2=0; row2<rows; row2++)
+      byContext[contextOf(row2)].push_back(row2) ;
+   // about 2^24 cells of work per class
+   int samples = width < 12 ? 1 << (24 - 2 * width) : 1 ;
+   std::mt19937 mt_rand(1) ;
+   // scoring runs evolveList(), which needs every order to be a permutation
+   for (int c=1; c<contexts; c++)
+      memcpy(valorder + ((long long)c << width), valorder, sizeof(row_t) * rows) ;
+   for (int c=0; c<contexts; c++) {
+      std::vector<int> &rs = byContext[c] ;
+      std::shuffle(rs.begin(), rs.end(), mt_rand) ;
+      int n = std::min<int>(samples, rs.size()) ;
+      std::vector<double> key(rows) ;
+      runThreads(threads, [&](int t) {
+         int *work = (int *)calloc(sizeof(int), 3LL << width) ;
+         std::vector<int> seen(rows, -1) ;
+         int stamp = 0 ;
+         for (int row3=t; row3<rows; row3 += threads) {
+            long long distinct = 0 ;
+            for (int i=0; i<n; i++) {
+               uint64_t fp ;
+               int good = evolveList(rs[i], row3, work, fp) ;
+               stamp++ ;
+               for (int j=0; j<good; j++)
+                  if (seen[work[j]] != stamp) {
+                     seen[work[j]] = stamp ;
+                     distinct++ ;
+                  }
+            }
+            key[row3] = (double)gcount[row3] / (1 + (double)distinct / n) ;
+         }
+         free(work) ;
+      }) ;
+      key[0] = -1 ;      // the empty row stays first to be tried
+      row_t *order = valorder + ((long long)c << width) ;
+      std::stable_sort(order, order + rows, [&](row_t a, row_t b) {
+         return key[a] > key[b] ;
+      }) ;
+   }
+}
+
+void RuleTable::genStatCounts() {
+   int *cnt = (int*)calloc((128 * sizeof(int)), 1LL << width) ;
+   for (int i=0; i<128<<width; i++)
+      cnt[i] = 0 ;
+   int s = 0 ;
+   if (symmetry == SYM_ODD)
+      s = 2 ;
+   else if (symmetry == SYM_EVEN)
+      s = 1 ;
+   else
+      s = width + 2 ;
+   // left side: never permit generation left of row4
+   for (int row1=0; row1<2; row1++)
+      for (int row2=0; row2<2; row2++)
+         for (int row3=0; row3<2; row3++)
+            if (evolveBit(row1, row2, row3) == 0)
+               cnt[(1<<6) + (row1 << 4) + (row2 << 2) + row3]++ ;
+   // each row4 prefix only feeds its own extensions, so the prefixes
+   // can be split among threads once there are enough of them
+   for (int nb=0; nb<width; nb++) {
+      int nthreads = nb < 12 ? 1 : threads ;
+      runThreads(nthreads, [&](int t) {
+         int lo = (int)(((long long)t << nb) / nthreads) ;
+         int hi = (int)(((long long)(t + 1) << nb) / nthreads) ;
+         for (int row1=0; row1<8; row1++)
+            for (int row2=0; row2<8; row2++)
+               for (int row3=0; row3<8; row3++) {
+                  if (nb == width-1)
+                     if ((((row1 >> s) ^ row1) & 1) ||
+                         (((row2 >> s) ^ row2) & 1) ||
+                         (((row3 >> s) ^ row3) & 1))
+                        continue ;
+                  int row4b = evolveBit(row1, row2, row3) ;
+                  for (int row4=lo; row4<hi; row4++)
+                     cnt[(((((1<<nb) + row4) << 1) + row4b) << 6) +
+                       ((row1 & 3) << 4) + ((row2 & 3) << 2) + (row3 & 3)] +=
+                        cnt[(((1<<nb) + row4) << 6) +
+                          ((row1 >> 1) << 4) + ((row2 >> 1) << 2) + (row3 >> 1)] ;
+               }
+      }) ;
+   }
+   // right side; check left, and accumulate into gcount
+   runThreads(width < 12 ? 1 : threads, [&](int t) {
+      int nthreads = width < 12 ? 1 : threads ;
+      int lo = (int)(((long long)t << width) / nthreads) ;
+      int hi = (int)(((long long)(t + 1) << width) / nthreads) ;
+      for (int row1=0; row1<4; row1++)
+         for (int row2=0; row2<4; row2++)
+            for (int row3=0; row3<4; row3++)
+               if (symmetry != SYM_ASYM ||
+                   evolveBit(row1<<1, row2<<1, row3<<1) == 0)
+                  for (int row4=lo; row4<hi; row4++)
+                     gcount[row4] +=
+                        cnt[(((1<<width) + row4) << 6) +
+                          (row1 << 4) + (row2 << 2) + row3] ;
+   }) ;
+   free(cnt) ;
+}
+
+void SearchListener::partial(Searcher &, const char *pat) {
+   printf("%s", pat);
+   fflush(stdout);
+}
+
+void SearchListener::ship(Searcher &, const char *pat, int shipCount) {
+   printf("\n");
+   printf("%s", pat);
+   printf("Spaceship found. (%d)\n\n",shipCount);
+   fflush(stdout);
+}
+
+void SearchListener::progress(Searcher &s, int depth, unsigned long long calcs, double cpuTime) {
+   if(depth >= 0) printf("Current depth: %d\n", depth);
+   printf("Calculations: ");
+   printf("%llu\n", calcs);
+   printf("CPU time: %f seconds\n",cpuTime);
+   printf("Successor lists: %.1f MB (%s; %.1f MB %s)\n", s.rt->listBytes / 1048576.0,
+          s.rt->compact ? "compact" : "dense", s.rt->otherLayoutBytes() / 1048576.0,
+          s.rt->compact ? "dense" : "compact");
+   fflush(stdout);
+}
+
+void SearchListener::finished(Searcher &s, int result, int shipCount, int depth) {
+   if (result == SEARCH_COMPLETE) {
+      if(shipCount == 1)printf("Search complete: 1 spaceship found.\n");
+      else printf("Search complete: %d spaceships found.\n",shipCount);
+   } else if (result == SEARCH_SHIPS) {
+      if(shipCount == 1)printf("Search terminated: spaceship found.\n");
+      else printf("Search terminated: %d spaceships found.\n",shipCount);
+   } else if (result == SEARCH_DEPTH) {
+      printf("Search terminated: depth limit reached.\n");
+      printf("Depth: %d\n", depth);
+      if(shipCount == 1)printf("1 spaceship found.\n");
+      else printf("%d spaceships found.\n",shipCount);
+   } else if (result == SEARCH_LIMIT) {
+      printf("Search terminated: node or time limit reached.\n");
+      if(shipCount == 1)printf("1 spaceship found.\n");
+      else printf("%d spaceships found.\n",shipCount);
+   }
+   if (s.knownShips)
+      printf("%d repeats of known spaceships not shown.\n", s.knownShips);
+   fflush(stdout);
+}
+
+void SearchListener::message(Searcher &, const char *msg) {
+   printf("%s\n", msg);
+   fflush(stdout);
+}
+
+static SearchListener defaultListener ;
+
+const char *KnownShips::open(const char *filename) {
+   fp = fopen(filename, "a+") ;
+   if (fp == 0)
+      return "Could not open known ships file" ;
+   rewind(fp) ;
+   unsigned long long key ;
+   while (fscanf(fp, "%llx", &key) == 1)
+      keys.insert(key) ;
+   fseek(fp, 0, SEEK_END) ;
+   return 0 ;
+}
+
+int KnownShips::add(uint64_t key) {
+   std::lock_guard<std::mutex> g(lock) ;
+   if (!keys.insert(key).second)
+      return 0 ;
+   if (fp) {
+      fprintf(fp, "%016llx\n", (unsigned long long)key) ;
+      fflush(fp) ;
+   }
+   return 1 ;
+}
+
+/*
+ *   Campaign index lines: the table, the normalized parameters, the
+ *   result (complete, ships or depth) with the ships found and the depth
+ *   reached, then # and a note.  Lines that don't parse are skipped.
+ */
+#define CAMPAIGNFORMAT "%s p%d k%d w%d y%d l%d m%d f%d t%d x%d n%d o%d c%d q%d d%d fold%d s%d %s %d %d # %s\n"
+static const char *campaignResults[] = { "complete", "ships", "depth" } ;
+
+const char *Campaign::open(const char *filename) {
+   fp = fopen(filename, "a+") ;
+   if (fp == 0)
+      return "Could not open campaign index" ;
+   rewind(fp) ;
+   char line[1024], table[1024], result[1024] ;
+   while (fgets(line, sizeof(line), fp)) {
+      Entry e ;
+      if (sscanf(line, "%1023s p%d k%d w%d y%d l%d m%d f%d t%d x%d n%d o%d c%d q%d d%d fold%d s%d %1023s %d %d",
+                 table, &e.p, &e.k, &e.w, &e.y, &e.l, &e.m, &e.f, &e.t, &e.x, &e.n,
+                 &e.o, &e.c, &e.q, &e.d, &e.fold, &e.s, result, &e.ships, &e.depth) != 20)
+         continue ;
+      e.result = -1 ;
+      for (int r=SEARCH_COMPLETE; r<=SEARCH_DEPTH; r++)
+         if (!strcmp(result, campaignResults[r]))
+            e.result = r ;
+      if (e.result < 0)
+         continue ;
+      e.table = table ;
+      const char *note = strstr(line, "# ") ;
+      e.note = note ? std::string(note + 2, strcspn(note + 2, "\n")) : "" ;
+      entries.push_back(e) ;
+   }
+   fseek(fp, 0, SEEK_END) ;
+   return 0 ;
+}
+
+int Campaign::lookup(const Entry &e, int &ships, int &depth, std::string &why) {
+   std::lock_guard<std::mutex> g(lock) ;
+   for (size_t i=0; i<entries.size(); i++) {
+      const Entry &d = entries[i] ;
+      if (d.table != e.table || d.p != e.p || d.k != e.k || d.y != e.y || d.m != e.m ||
+          d.f != e.f || d.t != e.t || d.x != e.x || d.n != e.n)
+         continue ;
+      int found = -1 ;            // the result e would have
+      if (d.result == SEARCH_COMPLETE) {
+         // the whole tree was seen, and no branch reached d.l
+         if (e.l >= d.l && (e.w == d.w || (e.w < d.w && d.ships == 0 && d.x == 0))) {
+            depth = -1 ;
+            if (e.s && e.s <= d.ships) {
+               ships = e.s ;
+               found = SEARCH_SHIPS ;
+            } else {
+               ships = d.ships ;
+               found = SEARCH_COMPLETE ;
+            }
+         }
+      } else if (e.w == d.w && e.l == d.l && e.o == d.o && e.c == d.c && e.q == d.q && e.d == d.d &&
+                 e.fold == d.fold && d.o != 2) {
+         // the same search in the same order: it finds the same ships first
+         if (e.s && e.s <= d.ships) {
+            ships = e.s ;
+            depth = e.s == d.ships ? d.depth : -1 ;
+            found = SEARCH_SHIPS ;
+         } else if (d.result == SEARCH_DEPTH) {
+            ships = d.ships ;
+            depth = d.depth ;
+            found = SEARCH_DEPTH ;
+         }
+      }
+      if (found < 0)
+         continue ;
+      char buf[100] ;
+      if (e.w == d.w)
+         sprintf(buf, "the same search") ;
+      else
+         sprintf(buf, "width %d", d.w) ;
+      why = buf ;
+      if (e.l != d.l) {
+         sprintf(buf, " to depth %d", d.l - 2 * d.p) ;
+         why += buf ;
+      }
+      why += " (" + d.note + ")" ;
+      return found ;
+   }
+   return SEARCH_RUNNING ;
+}
+
+void Campaign::add(const Entry &e) {
+   std::lock_guard<std::mutex> g(lock) ;
+   entries.push_back(e) ;
+   if (fp) {
+      fprintf(fp, CAMPAIGNFORMAT, e.table.c_str(), e.p, e.k, e.w, e.y, e.l, e.m, e.f, e.t, e.x, e.n,
+              e.o, e.c, e.q, e.d, e.fold, e.s, campaignResults[e.result], e.ships, e.depth, e.note.c_str()) ;
+      fflush(fp) ;
+   }
+}
+
+Searcher::Searcher(RuleTable &r, SearchListener *l) {
+   rt = &r ;
+   listener = l ? l : &defaultListener ;
+   lastError = 0 ;
+   for (int i=0; i<NUM_PARAMS; i++)
+      sp[i] = 0 ;
+   period = offset = width = rowNum = 0 ;
+   cachemem = 32 ;
+   dumpFlag = 0 ;
+   dumpNum = 1 ;
+   buf = 0 ;
+   pRows = 0 ;
+   calcs = 0 ;
+   cacheLookups = cacheHits = 0 ;
+   trace = 0 ;
+   traceA = 0 ;
+   gInd3 = 0 ;
+   compact = 0 ;
+   mapWords = 1 ;
+   fold = 0 ;
+   revRow = 0 ;
+   pInd = 0 ;
+   pRemain = 0 ;
+   pMir = 0 ;
+   snapRows = 0 ;
+   snapRow = 0 ;
+   reportInterval = 0 ;
+   maxCalcs = ~0ULL ;
+   maxSeconds = 0 ;
+   known = 0 ;
+   knownShips = 0 ;
+   campaign = 0 ;
+   controlFile = 0 ;
+   controlAt = 0 ;
+   tightened = 0 ;
+   reportPending = 0 ;
+   lastNonempty = 0 ;
+   dumpPeriod = 0xffffffffffffffff;  // default dump period is 2^64, so the state will never be dumped
+   shipNum = firstFull = 0 ;
+   fpBitmask = 0 ;
+   phase = 0 ;
+   twoSubPeriods = 0 ;
+   for (int i=0; i<MAXPERIOD; i++)
+      equivRow[i] = equivRow2[i] = 0 ;
+#ifdef KNIGHT
+   for (int i=0; i<MAXPERIOD; i++)
+      kshiftb[i] = kshift0[i] = kshift1[i] = kshift2[i] = kshift3[i] = 0 ;
+#endif
+   cachesize = 0 ;
+   cache = 0 ;
+   memomem = 0 ;
+   queuemem = 0 ;
+   relayoutSeconds = 0 ;
+   profile = -1 ;
+   hits = 0 ;
+   lastShips = lastDepth = 0 ;
+   ldsMax = -1 ;
+   ldsUsed = ldsTaken = 0 ;
+   ldsLimit = ldsFloor = ldsCut = 0 ;
+   relayoutAt = 0 ;
+   queue = 0 ;
+   qhash = 0 ;
+   qcap = qmask = 0 ;
+   rowSelf = 0 ;
+   qreach = qskip = 0 ;
+   qdups = qprunes = 0 ;
+   qpeak = 0 ;
+   qprobeRows = 0 ;
+   qspan = 0 ;
+   memosize = 0 ;
+   memo = 0 ;
+   memoLookups = memoHits = 0 ;
+   loadFailed = 0 ;
+}
+
+Searcher::~Searcher() {
+   free(buf) ;
+   free(pRows) ;
+   free(pInd) ;
+   free(pRemain) ;
+   free(pMir) ;
+   free(snapRows) ;
+   free(lastNonempty) ;
+   free(cache) ;
+   free(memo) ;
+   free(queue) ;
+   free(qhash) ;
+   free(rowSelf) ;
+   free(hits) ;
+   free(ldsUsed) ;
+   free(ldsTaken) ;
+   if (trace)
+      fclose(trace) ;
+}
+
+void Searcher::makePhases(){
+   int i;
+   for (i = 0; i < period; i++) backOff[i] = -1;
+   i = 0;
+   for (;;) {
+      int j = offset;
+      while (backOff[(i+j)%period] >= 0 && j < period) j++;
+      if (j == period) {
+         backOff[i] = period-i;
+         break;
       }
-      h = (h + 1) & ((2 << (2 * width)) - 1) ;
+      backOff[i] = j;
+      i = (i+j)%period;
+   }
+   for (i = 0; i < period; i++)
+      fwdOff[(i+backOff[i])%period] = backOff[i];
+   for (i = 0; i < period; i++) {
+      int j = (i - fwdOff[i]);
+      if (j < 0) j += period;
+      doubleOff[i] = fwdOff[i] + fwdOff[j];
+   }
+   for (i = 0; i <  period; i++){
+      int j = (i - fwdOff[i]);
+      if (j < 0) j += period;
+      tripleOff[i] = fwdOff[i] + doubleOff[j];
    }
-   gInd3[(row1<<width)+row2] = row ;
-/*
- *   For debugging:
- *
-   printf("R") ;
-   for (int i=0; i<1+(1<<width)+good; i++)
-      printf(" %d", row[i]) ;
-   printf("\n") ;
-   fflush(stdout) ;
- */
-   return row ;
 }
 
 /*
- *   We calculate the stats using a 2 * 64 << width array.  We use a
- *   leading 1 to separate them.  Index 1 aaa bb cc dd represents
- *   the count for a result of aaa when the last two bits of row1, row2,
- *   and row3 were bb, cc, and dd, respectively.  We have to manage
- *   the edge conditions appropriately.
- */
-void genStatCounts() {
-   int *cnt = (int*)calloc((128 * sizeof(int)), 1LL << width) ;
-   for (int i=0; i<128<<width; i++)
-      cnt[i] = 0 ;
-   int s = 0 ;
-   if (sp[P_SYMMETRY] == SYM_ODD)
-      s = 2 ;
-   else if (sp[P_SYMMETRY] == SYM_EVEN)
-      s = 1 ;
-   else
-      s = width + 2 ;
-   // left side: never permit generation left of row4
-   for (int row1=0; row1<2; row1++)
-      for (int row2=0; row2<2; row2++)
-         for (int row3=0; row3<2; row3++)
-            if (evolveBit(row1, row2, row3) == 0)
-               cnt[(1<<6) + (row1 << 4) + (row2 << 2) + row3]++ ;
-   for (int nb=0; nb<width; nb++) {
-      for (int row1=0; row1<8; row1++)
-         for (int row2=0; row2<8; row2++)
-            for (int row3=0; row3<8; row3++) {
-               if (nb == width-1)
-                  if ((((row1 >> s) ^ row1) & 1) ||
-                      (((row2 >> s) ^ row2) & 1) ||
-                      (((row3 >> s) ^ row3) & 1))
-                     continue ;
-               int row4b = evolveBit(row1, row2, row3) ;
-               for (int row4=0; row4<1<<nb; row4++)
-                  cnt[(((((1<<nb) + row4) << 1) + row4b) << 6) +
-                    ((row1 & 3) << 4) + ((row2 & 3) << 2) + (row3 & 3)] +=
-                     cnt[(((1<<nb) + row4) << 6) +
-                       ((row1 >> 1) << 4) + ((row2 >> 1) << 2) + (row3 >> 1)] ;
-            }
-   }
-   // right side; check left, and accumulate into gcount
-   for (int row1=0; row1<4; row1++)
-      for (int row2=0; row2<4; row2++)
-         for (int row3=0; row3<4; row3++)
-            if (sp[P_SYMMETRY] != SYM_ASYM ||
-                evolveBit(row1<<1, row2<<1, row3<<1) == 0)
-               for (int row4=0; row4<1<<width; row4++)
-                  gcount[row4] +=
-                     cnt[(((1<<width) + row4) << 6) +
-                       (row1 << 4) + (row2 << 2) + row3] ;
-   free(cnt) ;
-}
+** For each possible phase of the ship, equivRow[phase] gives the row that
+** is equivalent if the pattern is subperiodic with a specified period.
+** equivRow2 is necessary if period == 12, 24, or 30, as then two subperiods
+** need to be tested (e.g., if period == 12, we must test subperiods 4 and 6).
+** twoSubPeriods is a flag that tells the program to test two subperiods.
+*/
 
-void printInfo(int currentDepth, unsigned long long numCalcs, double runTime){
-   if(currentDepth >= 0) printf("Current depth: %d\n", currentDepth - 2*period);
-   printf("Calculations: ");
-   printf("%llu\n", numCalcs);
-   printf("CPU time: %f seconds\n",runTime);
-   fflush(stdout);
+void Searcher::makeEqRows(int maxFactor, int a){
+   int tempEquivRow[MAXPERIOD];
+   int i,j;
+   for(i = 0; i < period; ++i){
+      tempEquivRow[i] = i;
+      for(j = 0; j < maxFactor; ++j){
+         tempEquivRow[i] += backOff[tempEquivRow[i] % period];
+      }
+      tempEquivRow[i] -= offset * maxFactor + i;
+      if(a == 1) equivRow[i] = tempEquivRow[i];
+      else equivRow2[i] = tempEquivRow[i];
+   }
+   for(i = 0; i < period; ++i){     // make equivRow[i] negative if possible
+      if(tempEquivRow[i] > 0){
+         if(a == 1) equivRow[i + tempEquivRow[i]] = -1 * tempEquivRow[i];
+         else equivRow2[i + tempEquivRow[i]] = -1 * tempEquivRow[i];
+      }
+   }
 }
 
 #ifdef KNIGHT
-int kshiftb[MAXPERIOD], kshift0[MAXPERIOD], kshift1[MAXPERIOD],
-    kshift2[MAXPERIOD], kshift3[MAXPERIOD] ;
-void makekshift(int a){
+void Searcher::makekshift(int a){
    int i;
    kshift0[a] = 1;
    for(i = 0; i < period; ++i){
@@ -511,27 +2374,27 @@ void makekshift(int a){
 
 
 
-void buffPattern(int theRow){
+void Searcher::buffPattern(const row_t *rows, int theRow){
    int firstRow = 2 * period;
    if(sp[P_INIT_ROWS]) firstRow = 0;
    int lastRow;
    int i, j;
    char *out = buf;
-   for(lastRow = theRow - 1; lastRow >= 0; --lastRow)if(pRows[lastRow])break;
-   
+   for(lastRow = theRow - 1; lastRow >= 0; --lastRow)if(rows[lastRow])break;
+
    for(i = firstRow; i <= lastRow; i += period){
       for(j = width - 1; j >= 0; --j){
-         if((pRows[i] >> j) & 1) out += sprintf(out, "o");
+         if((rows[i] >> j) & 1) out += sprintf(out, "o");
          else out += sprintf(out, ".");
       }
       if(sp[P_SYMMETRY] != SYM_ASYM){
          if(sp[P_SYMMETRY] == SYM_GUTTER) out += sprintf(out, ".");
          if(sp[P_SYMMETRY] != SYM_ODD){
-            if (pRows[i] & 1) out += sprintf(out, "o");
+            if (rows[i] & 1) out += sprintf(out, "o");
             else out += sprintf(out, ".");
          }
          for(j = 1; j < width; ++j){
-            if((pRows[i] >> j) & 1) out += sprintf(out, "o");
+            if((rows[i] >> j) & 1) out += sprintf(out, "o");
             else out += sprintf(out, ".");
          }
       }
@@ -540,57 +2403,86 @@ void buffPattern(int theRow){
    out += sprintf(out, "Length: %d\n", lastRow - 2 * period + 1);
 }
 
-void printPattern(){
-   printf("%s", buf);
-   fflush(stdout);
-}
-int cachemem = 32 ; // megabytes for the cache
-long long cachesize ;
-struct cacheentry {
-   uint16_t *p1, *p2, *p3 ;
-   int abn, r ;
-} *cache ;
-int getkey(uint16_t *p1, uint16_t *p2, uint16_t *p3, int abn) {
+int Searcher::getkey(row_t *p1, row_t *p2, row_t *p3, int abn) {
    unsigned long long h = (unsigned long long)p1 +
       17 * (unsigned long long)p2 + 257 * (unsigned long long)p3 +
       513 * abn ;
    h = h + (h >> 15) ;
    h &= (cachesize-1) ;
    struct cacheentry &ce = cache[h] ;
-   if (ce.p1 == p1 && ce.p2 == p2 && ce.p3 == p3 && ce.abn == abn)
+   cacheLookups++ ;
+   if (ce.p1 == p1 && ce.p2 == p2 && ce.p3 == p3 && ce.abn == abn) {
+      cacheHits++ ;
       return -2 + ce.r ;
+   }
    ce.p1 = p1 ;
    ce.p2 = p2 ;
    ce.p3 = p3 ;
    ce.abn = abn ;
    return h ;
 }
-void setkey(int h, int v) {
+void Searcher::setkey(int h, int v) {
    cache[h].r = v ;
 }
-int lookAhead(int a){
+/*
+ *   The inner memo answers the innermost question of lookAhead(): given
+ *   the successor lists at riStart22 and riStart23 and the row13 whose
+ *   pairs with each row23 are looked up, is any of the combinations
+ *   nonempty?  The same pair of lists turns up under different outer
+ *   keys, but on the searches we have traced the hit rate is low (a few
+ *   percent, more at small widths) and most inner loops are cheaper to
+ *   redo than a probe that misses the CPU cache, so only loops of at
+ *   least MEMOTHRESH combinations are memoized, and only with --memo.
+ *   Like getkey(), this returns -2 plus the answer on a hit, or the slot
+ *   to store the answer in (via memo[h].r) once it is known.
+ */
+#ifndef MEMOTHRESH
+#define MEMOTHRESH 128
+#endif
+int Searcher::getmemo(row_t *p22, row_t *p23, int row13) {
+   unsigned long long h = (unsigned long long)p22 +
+      31 * (unsigned long long)p23 + 1021 * row13 ;
+   h = h + (h >> 17) ;
+   h &= (memosize-1) ;
+   struct memoentry &me = memo[h] ;
+   memoLookups++ ;
+   if (me.p22 == p22 && me.p23 == p23 && me.row13 == row13) {
+      memoHits++ ;
+      return -2 + me.r ;
+   }
+   me.p22 = p22 ;
+   me.p23 = p23 ;
+   me.row13 = row13 ;
+   return h ;
+}
+/*
+ *   With FOLD every row read from a list goes through unfold(); without
+ *   it this is the plain lookahead, with nothing extra in the loops.
+ */
+template <int FOLD> int Searcher::lookAheadT(int a){
    int ri11, ri12, ri13, ri22, ri23;  //indices: first number represents vertical offset, second number represents generational offset
-   uint16_t *riStart11, *riStart12, *riStart13, *riStart22, *riStart23;
+   row_t *riStart11, *riStart12, *riStart13, *riStart22, *riStart23;
    int numRows11, numRows12, numRows13, numRows22, numRows23;
    int row11, row12, row13, row22, row23;
+   unsigned char m11 = 0, m12 = 0, m13 = 0, m22 = 0, m23 = 0 ;   // see getoffsetcount()
 
-   getoffsetcount(pRows[a - sp[P_PERIOD] - fwdOff[phase]],
+   getoffsetcount<FOLD>(pRows[a - sp[P_PERIOD] - fwdOff[phase]],
                   pRows[a - fwdOff[phase]],
 #ifdef KNIGHT
-                  pRows[a] >> kshift0[phase], riStart11, numRows11) ;
+                  pRows[a] >> kshift0[phase], riStart11, numRows11, m11) ;
 #else
-                  pRows[a], riStart11, numRows11) ;
+                  pRows[a], riStart11, numRows11, m11) ;
 #endif
    if (!numRows11)
       return 0 ;
-   getoffsetcount(pRows[a - sp[P_PERIOD] - doubleOff[phase]],
+   getoffsetcount<FOLD>(pRows[a - sp[P_PERIOD] - doubleOff[phase]],
                   pRows[a - doubleOff[phase]],
 #ifdef KNIGHT
-                  pRows[a - fwdOff[phase]] >> kshift1[phase], riStart12, numRows12) ;
+                  pRows[a - fwdOff[phase]] >> kshift1[phase], riStart12, numRows12, m12) ;
 #else
-                  pRows[a - fwdOff[phase]], riStart12, numRows12) ;
+                  pRows[a - fwdOff[phase]], riStart12, numRows12, m12) ;
 #endif
-   
+
    if(tripleOff[phase] >= sp[P_PERIOD]){
       int off = a + sp[P_PERIOD] - tripleOff[phase] ;
       if (off < 2 * sp[P_PERIOD]) { // always zero if here
@@ -598,18 +2490,19 @@ int lookAhead(int a){
       } else {
          // must *not* point to stack here to keep cache consistent!
          riStart13 = pInd[off] + pRemain[off];
+         m13 = FOLD && pMir[off] ;
       }
       numRows13 = 1 ;
    } else {
-      getoffsetcount(pRows[a - sp[P_PERIOD] - tripleOff[phase]],
+      getoffsetcount<FOLD>(pRows[a - sp[P_PERIOD] - tripleOff[phase]],
                      pRows[a - tripleOff[phase]],
 #ifdef KNIGHT
-                     pRows[a - doubleOff[phase]] >> kshift2[phase], riStart13, numRows13) ;
+                     pRows[a - doubleOff[phase]] >> kshift2[phase], riStart13, numRows13, m13) ;
 #else
-                     pRows[a - doubleOff[phase]], riStart13, numRows13) ;
+                     pRows[a - doubleOff[phase]], riStart13, numRows13, m13) ;
 #endif
    }
-   int k = getkey(riStart11, riStart12, riStart13,
+   int k = getkey(tag(riStart11, m11), tag(riStart12, m12), tag(riStart13, m13),
 #ifdef KNIGHT
     (phase << (2 * width)) +
 #endif
@@ -618,50 +2511,70 @@ int lookAhead(int a){
    if (k < 0)
       return k+2 ;
    for(ri11 = 0; ri11 < numRows11; ++ri11){
-      row11 = riStart11[ri11];
+      row11 = unfold(m11, riStart11[ri11]) ;
 #ifdef KNIGHT
       if (kshift1[phase] && (row11 & 1))
          continue ;
       row11 >>= kshift1[phase] ;
 #endif
       for(ri12 = 0; ri12 < numRows12; ++ri12){
-         row12 = riStart12[ri12] ;
+         row12 = unfold(m12, riStart12[ri12]) ;
 #ifdef KNIGHT
          if (kshift2[phase] && (row12 & 1))
             continue ;
          row12 >>= kshift2[phase] ;
 #endif
-         getoffsetcount(pRows[a - doubleOff[phase]],
-                        row12, row11, riStart22, numRows22) ;
+         getoffsetcount<FOLD>(pRows[a - doubleOff[phase]],
+                        row12, row11, riStart22, numRows22, m22) ;
          if(!numRows22) continue;
-         
+
          for(ri13 = 0; ri13 < numRows13; ++ri13){
-            row13 = riStart13[ri13] ;
+            row13 = unfold(m13, riStart13[ri13]) ;
 #ifdef KNIGHT
             if (kshift3[phase] && (row13 & 1))
                continue ;
             row13 >>= kshift3[phase] ;
 #endif
-            getoffsetcount(pRows[a - tripleOff[phase]],
-                           row13, row12, riStart23, numRows23) ;
+            getoffsetcount<FOLD>(pRows[a - tripleOff[phase]],
+                           row13, row12, riStart23, numRows23, m23) ;
             if(!numRows23) continue;
-            
+            int m = -3 ;
+            if (memo && numRows22 * numRows23 >= MEMOTHRESH) {
+               // kshift3 filters row22, so it is part of the key
+#ifdef KNIGHT
+               m = getmemo(tag(riStart22, m22), tag(riStart23, m23), (row13 << 1) + kshift3[phase]) ;
+#else
+               m = getmemo(tag(riStart22, m22), tag(riStart23, m23), row13) ;
+#endif
+               if (m == -1) {
+                  setkey(k, 1) ;
+                  return 1 ;
+               }
+               if (m == -2)
+                  continue ;
+            }
+
             for(ri23 = 0; ri23 < numRows23; ++ri23){
-               row23 = riStart23[ri23] ;
-               uint16_t *p = getoffset(row13, row23) ;
+               row23 = unfold(m23, riStart23[ri23]) ;
+               row_t *p = getoffset(row13, row23) ;
+               int mp = FOLD && mirrored(row13, row23) ;
                for(ri22 = 0; ri22 < numRows22; ++ri22){
-                  row22 = riStart22[ri22] ;
+                  row22 = unfold(m22, riStart22[ri22]) ;
 #ifdef KNIGHT
                   if (kshift3[phase] && (row22 & 1))
                      continue ;
                   row22 >>= kshift3[phase] ;
 #endif
-                  if (p[row22+1]!=p[row22]) {
+                  if (nonempty(p, unfold(mp, row22))) {
+                     if (m >= 0)
+                        memo[m].r = 1 ;
                      setkey(k, 1) ;
                      return 1 ;
                   }
                }
             }
+            if (m >= 0)
+               memo[m].r = 0 ;
          }
       }
    }
@@ -669,17 +2582,9 @@ int lookAhead(int a){
    return 0;
 }
 
-int dumpNum = 1;
-char dumpFile[12];
 #define DUMPROOT "dump"
-int dumpFlag = 0; /* Dump status flags, possible values follow */
-#define DUMPPENDING (1)
-#define DUMPFAILURE (2)
-#define DUMPSUCCESS (3)
 
-int dumpandexit = 0;
-
-FILE * openDumpFile(){
+FILE * Searcher::openDumpFile(){
     FILE * fp;
 
     while (dumpNum < 10000)
@@ -693,13 +2598,12 @@ FILE * openDumpFile(){
     return (FILE *) 0;
 }
 
-void dumpState(int v){ // v = rowNum
-    printf("Dumping state not supported at the moment.\n") ;
-    exit(10) ;
+const char *Searcher::dumpState(int v){ // v = rowNum
+    return "Dumping state not supported at the moment." ;
     FILE * fp;
     int i;
     dumpFlag = DUMPFAILURE;
-    if (!(fp = openDumpFile())) return;
+    if (!(fp = openDumpFile())) return 0;
     fprintf(fp,"%lu\n",FILEVERSION);
     for (i = 0; i < NUM_PARAMS; i++)
        fprintf(fp,"%d\n",sp[i]);
@@ -717,15 +2621,85 @@ void dumpState(int v){ // v = rowNum
     }
     fclose(fp);
     dumpFlag = DUMPSUCCESS;
+    return 0;
 }
 
-int checkInteract(int a){
+int Searcher::checkInteract(int a){
    int i;
    for(i = a - period; i > a - 2*period; --i){
-      if(ev2Rows[(pRows[i] << width) + pRows[i + period]] != pRows[i + backOff[i % period]]) return 1;
+      if(rt->ev2Rows[(pRows[i] << width) + pRows[i + period]] != pRows[i + backOff[i % period]]) return 1;
    }
    return 0;
 }
+/*
+ *   A key for the ship in pRows[0..theRow) that does not depend on the
+ *   phase it was found in, which way round it is, or where it sits in
+ *   the search width.  Each phase is laid out full width, as
+ *   buffPattern() shows it, and trimmed of empty rows and columns; the
+ *   smallest hash over the phases and their mirror images, mixed with
+ *   the rule and speed, is the key.  This is a few thousand operations,
+ *   next to nothing beside the search that found the ship.
+ */
+uint64_t Searcher::shipKey(int theRow) {
+   int sym = sp[P_SYMMETRY] ;
+   int full = width ;
+   if (sym != SYM_ASYM)
+      full = 2 * width - (sym == SYM_ODD) + (sym == SYM_GUTTER) ;
+   std::vector<uint64_t> img ;
+   uint64_t best = ~0ULL ;
+   for (int ph=0; ph<period; ph++) {
+      img.clear() ;
+      uint64_t cols = 0 ;
+      for (int i=ph; i<theRow; i+=period) {
+         uint64_t r = 0 ;
+         for (int j=width-1; j>=0; j--)
+            r = (r << 1) | ((pRows[i] >> j) & 1) ;
+         if (sym != SYM_ASYM)
+            for (int j=(sym == SYM_ODD); j<width; j++)
+               r = (r << 1) | ((pRows[i] >> j) & 1) ;
+         if (sym == SYM_GUTTER)   // the empty centre column
+            r = ((r >> width) << (width + 1)) | (r & ((1ULL << width) - 1)) ;
+         if (r == 0 && img.size() == 0)
+            continue ;
+         img.push_back(r) ;
+         cols |= r ;
+      }
+      while (img.size() && img.back() == 0)
+         img.pop_back() ;
+      if (cols == 0)
+         continue ;
+      for (int mirror=0; mirror<2; mirror++) {
+         uint64_t h = 0x9e3779b97f4a7c15ULL ;
+         int shift = 0 ;
+         uint64_t c = cols ;
+         if (mirror) {
+            c = 0 ;
+            for (int j=0; j<full; j++)
+               c |= ((cols >> j) & 1) << (full - 1 - j) ;
+         }
+         while (!((c >> shift) & 1))
+            shift++ ;
+         for (size_t i=0; i<img.size(); i++) {
+            uint64_t r = img[i] ;
+            if (mirror) {
+               r = 0 ;
+               for (int j=0; j<full; j++)
+                  r |= ((img[i] >> j) & 1) << (full - 1 - j) ;
+            }
+            h = (h ^ (r >> shift)) * 0xff51afd7ed558ccdULL ;
+            h ^= h >> 32 ;
+         }
+         h ^= img.size() ;
+         if (h < best)
+            best = h ;
+      }
+   }
+   uint64_t h = best ;
+   for (int i=0; i<512; i++)
+      h = (h ^ rt->nttable2[i]) * 0x100000001b3ULL ;
+   h = (h ^ ((uint64_t)period << 32 | offset << 8 | sp[P_X_OFFSET])) * 0xc4ceb9fe1a85ec53ULL ;
+   return h ^ (h >> 33) ;
+}
 /*
  *   Symmetry breaking for asymmetric searches:
  *
@@ -733,7 +2707,7 @@ int checkInteract(int a){
  *   Return 0 if bitreverse(v) == v
  *   Return 1 if bitreverse(v) < v
  */
-int checkPalindrome(int v) {
+int Searcher::checkPalindrome(int v) {
    for (int i=0; i+i<width; i++) {
       int t = ((v >> i) & 1) - ((v >> (width - 1 - i)) & 1) ;
       if (t)
@@ -741,65 +2715,408 @@ int checkPalindrome(int v) {
    }
    return 0 ;
 }
-void search(){
-   uint32_t currRow = rowNum;    // currRow == index of current row
-   int j;
-   unsigned long long calcs, lastLong;
-   int noship = 0;
-   int totalShips = 0;
+int Searcher::search(){
+   int result;
+   Campaign::Entry entry;
+   Campaign *index = sp[P_INIT_ROWS] ? 0 : campaign;    // the key doesn't cover initial rows
+   if (index) {
+      campaignEntry(entry);
+      int ships, depth;
+      std::string why;
+      result = index->lookup(entry, ships, depth, why);
+      if (result != SEARCH_RUNNING) {
+         why = "Campaign index: answered by " + why;
+         if (ships)
+            why += "; rerun without --campaign to see the ships";
+         listener->message(*this, why.c_str());
+         finish(result, ships, depth);
+         return result;
+      }
+   }
+   if (ldsMax >= 0) {
+      result = ldsSearch();
+   } else if (queuemem > 0) {
+      if (profile >= 0 && hits == 0)
+         hits = (uint32_t *)calloc(sizeof(*hits), 1LL << (2 * width));
+      result = hybridSearch();
+   } else {
+      beginSearch();
+      result = searchLoop<0>();
+   }
+   if (profile >= 0)
+      profileReport();
+   if (index && (result == SEARCH_COMPLETE || result == SEARCH_SHIPS || result == SEARCH_DEPTH) &&
+       !(known && known->skip) && !tightened) {
+      entry.result = result;
+      entry.ships = lastShips + knownShips;
+      entry.depth = lastDepth;
+      char note[400];
+      time_t now = time(0);
+      char stamp[32];
+      strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+      sprintf(note, "%.255s, %llu calculations, %s", rt->rule, calcs, stamp);
+      entry.note = note;
+      index->add(entry);
+   }
+   return result;
+}
+
+void Searcher::finish(int result, int shipCount, int depth){
+   lastShips = shipCount;
+   lastDepth = depth;
+   listener->finished(*this, result, shipCount, depth);
+}
+
+// this search as a campaign index entry, before any ships are found
+void Searcher::campaignEntry(Campaign::Entry &e){
+   static const char hex[] = "0123456789abcdef";
+   e.table.clear();
+   for (int i=0; i<512; i += 4)
+      e.table += hex[rt->nttable2[i] | rt->nttable2[i+1] << 1 | rt->nttable2[i+2] << 2 | rt->nttable2[i+3] << 3];
+   e.p = sp[P_PERIOD];
+   e.k = sp[P_OFFSET];
+   e.w = sp[P_WIDTH];
+   e.y = sp[P_SYMMETRY];
+   e.l = sp[P_DEPTH_LIMIT];
+   e.m = sp[P_MAX_LENGTH];
+   e.f = sp[P_FULL_PERIOD];
+   e.t = sp[P_FULL_WIDTH];
+   e.x = sp[P_X_OFFSET];
+   e.n = sp[P_KNIGHT_PHASE];
+   e.o = sp[P_REORDER];
+   e.c = sp[P_REORDER] == 4 ? rt->contexts : 0;
+   e.q = queuemem;
+   e.d = ldsMax;
+   e.fold = rt->fold;
+   e.s = sp[P_NUM_SHIPS] > 0 ? sp[P_NUM_SHIPS] : 0;
+   e.result = SEARCH_RUNNING;
+   e.ships = e.depth = 0;
+}
+
+void Searcher::profileReport(){
+   std::vector<std::string> lines;
+   rt->profile(hits, profile, lines);
+   for (size_t i=0; i<lines.size(); i++)
+      listener->message(*this, lines[i].c_str());
+}
+
+void Searcher::beginSearch(){
+   run.currRow = rowNum;         // currRow == index of current row
+   run.totalShips = 0;
    calcs = 0;                    // calcs == "calculations" == number of times through the main loop
-   uint32_t longest = 0;         // length of the longest partial seen so far
-   lastLong = 0;                 // number of calculations at which longest was updated
-   int buffFlag = 0;
-   double ms = get_cpu_time();
-   phase = currRow % period;
-   int firstasymm = 0 ;
+   run.longest = 0;              // length of the longest partial seen so far
+   run.lastLong = 0;             // number of calculations at which longest was updated
+   run.buffFlag = 0;
+   run.ms = get_cpu_time();
+   run.nextReport = time(0) + reportInterval;
+   run.stopTime = time(0) + maxSeconds;
+   phase = run.currRow % period;
+   run.firstasymm = 0 ;
    if (sp[P_SYMMETRY] == SYM_ASYM && sp[P_X_OFFSET] == 0)
-      firstasymm = currRow ;
+      run.firstasymm = run.currRow ;
+   run.stage = 0 ;
+   if ((relayoutSeconds > 0 || profile >= 0) && hits == 0)
+      hits = (uint32_t *)calloc(sizeof(*hits), 1LL << (2 * width)) ;
+   if (relayoutSeconds > 0)
+      relayoutAt = time(0) + relayoutSeconds ;
+}
+
+/*
+ *   Have the table relayout() its lists by how often they were read
+ *   since the search began, then find the stack's lists again where
+ *   they now are (as start() and the search found them) and empty the
+ *   caches, whose keys are list pointers.  a is the current row.
+ */
+void Searcher::relayout(int a){
+   long long before = get_resident_bytes() ;
+   double t = get_wall_time() ;
+   char report[200] ;
+   const char *err = rt->relayout(hits, report) ;
+   if (profile < 0) {
+      free(hits) ;
+      hits = 0 ;
+   }
+   relayoutAt = 0 ;
+   if (err) {
+      sprintf(errbuf, "Relayout skipped: %s", err) ;
+      listener->message(*this, errbuf) ;
+      return ;
+   }
+   int n ;
+   for (int i=2*period; i<=a; i++) {
+      int ph = i % period ;
+      if (i == 2 * period && !sp[P_INIT_ROWS]) {
+         getoffsetcount(0, 0, 0, pInd[i], n) ;
+         pMir[i] = 0 ;
+      } else if (i == 2 * period) {
+         getoffsetcount<1>(pRows[0], pRows[period], pRows[period+backOff[0]],
+                           pInd[i], n, pMir[i]) ;
+      } else {
+         getoffsetcount<1>(pRows[i - 2 * period],
+                           pRows[i - period],
+#ifdef KNIGHT
+                           pRows[i - period + backOff[ph]] >> kshiftb[ph],
+#else
+                           pRows[i - period + backOff[ph]],
+#endif
+                           pInd[i], n, pMir[i]) ;
+      }
+   }
+   memset(cache, 0, sizeof(cacheentry) * cachesize) ;
+   if (memo)
+      memset(memo, 0, sizeof(memoentry) * memosize) ;
+   long long after = get_resident_bytes() ;
+   sprintf(errbuf, "Relayout: %.140s; resident %.1f MB before, %.1f MB after (%.2f seconds)",
+           report, before / 1048576.0, after / 1048576.0, get_wall_time() - t) ;
+   listener->message(*this, errbuf) ;
+}
+
+/*
+ *   Live tightening (--control FF): every few seconds of search(), and
+ *   on SIGUSR1, the control file is read, and if it has changed its
+ *   options (m, t, s and l, as on the command line) are applied to the
+ *   rest of the tree where they are tighter than the search's own.
+ *   Looser ones are ignored, so every ship already shown stays valid.
+ *   Rows on the stack that a new m or t rules out are backed out of,
+ *   and if the stack is already past a new depth limit its row at the
+ *   limit is tried again, so the rest of the search is what a search
+ *   with the new limits would do.  a is the current row; returns -1 if
+ *   the new ship count has already been reached.
+ */
+int Searcher::applyControl(int a, int totalShips){
+   controlAt = time(0) + 5 ;
+   FILE *f = fopen(controlFile, "r") ;
+   if (f == 0)
+      return 0 ;
+   std::string text ;
+   char line[256] ;
+   while (fgets(line, sizeof(line), f))
+      if (line[0] != '#')
+         text += line ;
+   fclose(f) ;
+   if (text == controlText)
+      return 0 ;
+   controlText = text ;
+   int abandon = -1 ;    // the first row on the stack that is ruled out
+   int retry = -1 ;      // or the row to try again at a new depth limit
+   int stop = 0 ;        // the ships wanted have already been found
+   char *save ;
+   for (char *tok = strtok_r(&text[0], " \t\r\n", &save); tok; tok = strtok_r(0, " \t\r\n", &save)) {
+      int v ;
+      const char *what = 0 ;
+      if (sscanf(tok + 1, "%d", &v) != 1 || v < 1)
+         what = "not understood" ;
+      else if (tok[0] == 'm' || tok[0] == 'M') {
+         if (sp[P_MAX_LENGTH] && v >= sp[P_MAX_LENGTH])
+            what = "not below the max length" ;
+         else {
+            sp[P_MAX_LENGTH] = v ;
+            if (sp[P_DEPTH_LIMIT] > v + 4 * period)
+               sp[P_DEPTH_LIMIT] = v + 4 * period ;
+            for (int i=v+2*period; i<a; i++)
+               if (pRows[i]) {
+                  if (abandon < 0 || i < abandon)
+                     abandon = i ;
+                  break ;
+               }
+         }
+      } else if (tok[0] == 't' || tok[0] == 'T') {
+         if (v >= width || (sp[P_FULL_WIDTH] && v >= sp[P_FULL_WIDTH]))
+            what = "not below the full period width" ;
+         else {
+            sp[P_FULL_WIDTH] = v ;
+            fpBitmask = 0 ;
+            for (int i=v; i<width; i++)
+               fpBitmask |= (1 << i) ;
+            for (int i=2*period; i<a; i++) {
+               int ph = i % period ;
+               if((pRows[i] & fpBitmask) && equivRow[ph] < 0 && pRows[i] != pRows[i + equivRow[ph]] &&
+                  (!twoSubPeriods || (equivRow2[ph] < 0 && pRows[i] != pRows[i + equivRow2[ph]]))) {
+                  if (abandon < 0 || i < abandon)
+                     abandon = i ;
+                  break ;
+               }
+            }
+         }
+      } else if (tok[0] == 's' || tok[0] == 'S') {
+         if (sp[P_NUM_SHIPS] > 0 && v >= totalShips + sp[P_NUM_SHIPS])
+            what = "not below the ships wanted" ;
+         else {
+            sp[P_NUM_SHIPS] = v - totalShips ;
+            stop = sp[P_NUM_SHIPS] <= 0 ;
+         }
+      } else if (tok[0] == 'l' || tok[0] == 'L') {
+         if (v + 2 * period >= sp[P_DEPTH_LIMIT])
+            what = "not below the depth limit" ;
+         else
+            sp[P_DEPTH_LIMIT] = v + 2 * period ;
+      } else
+         what = "not m, t, s or l" ;
+      if (what)
+         sprintf(errbuf, "Control: %.20s ignored (%s)", tok, what) ;
+      else {
+         sprintf(errbuf, "Control: %.20s applied", tok) ;
+         tightened = 1 ;
+      }
+      listener->message(*this, errbuf) ;
+   }
+   if (stop)
+      return -1 ;
+   if (a > sp[P_DEPTH_LIMIT] && (abandon < 0 || abandon > sp[P_DEPTH_LIMIT]))
+      retry = sp[P_DEPTH_LIMIT] ;
+   int cut = retry >= 0 ? retry : abandon ;
+   if (cut < 0)
+      return 0 ;
+   // the loop backs up through rows with nothing left, as it always does
+   for (int i=cut+1; i<=a; i++)
+      pRemain[i] = 0 ;
+   if (retry >= 0) {
+      pRemain[cut]++ ;
+      if (ldsUsed)
+         ldsTaken[cut]-- ;
+   }
+   sprintf(errbuf, "Control: backing up from row %d to row %d", a - 2 * period, cut - 2 * period) ;
+   listener->message(*this, errbuf) ;
+   return 0 ;
+}
+
+/*
+ *   Run one search interleaved with others on the same thread: go on
+ *   until the next row has passed its cheap checks, start fetching the
+ *   table entries its lookahead will read, and return SEARCH_RUNNING so
+ *   the others get a turn while the loads are in flight.  The entries
+ *   are two dependent loads deep (gInd3, then the list), so a row takes
+ *   two turns.  Otherwise this is search(), and so finds the same things.
+ */
+int Searcher::step(){
+   return searchLoop<1>();
+}
+
+/*
+ *   Prefetch for lookAhead(a): stage 0 the gInd3 entries for its first
+ *   three lists, stage 1 the offsets within those lists.
+ */
+void Searcher::prefetchAhead(int a, int stage){
+   int n = tripleOff[phase] >= sp[P_PERIOD] ? 2 : 3 ;
+   const int *off[3] = { fwdOff, doubleOff, tripleOff } ;
+   for (int i=0; i<n; i++) {
+      int o = off[i][phase] ;
+      int row12 = (pRows[a - sp[P_PERIOD] - o] << width) + pRows[a - o] ;
+      if (stage == 0) {
+         __builtin_prefetch(&gInd3[row12]) ;
+         continue ;
+      }
+      const row_t *row = gInd3[row12] ;
+      if (row == 0)
+         continue ;
+      int row3 = i == 0 ? pRows[a] : pRows[a - off[i-1][phase]] ;
+#ifdef KNIGHT
+      row3 >>= (i == 0 ? kshift0 : i == 1 ? kshift1 : kshift2)[phase] ;
+#endif
+      if (mirrored(row12 >> width, row12 & ((1 << width) - 1)))
+         row3 = revRow[row3] ;
+      if (compact) {
+         __builtin_prefetch(row + (row3 >> 6) * (sizeof(uint64_t) / sizeof(row_t))) ;
+         __builtin_prefetch(row + mapWords * (sizeof(uint64_t) / sizeof(row_t)) + (row3 >> 6)) ;
+      } else
+         __builtin_prefetch(row + row3) ;
+   }
+}
+
+template <int YIELD> int Searcher::searchLoop(){
+   uint32_t currRow = run.currRow;
+   int j;
+   unsigned long long lastLong = run.lastLong;
+   int noship = 0;
+   int totalShips = run.totalShips;
+   uint32_t longest = run.longest;
+   int buffFlag = run.buffFlag;
+   double ms = run.ms;
+   time_t nextReport = run.nextReport;
+   time_t stopTime = run.stopTime;
+   int firstasymm = run.firstasymm ;
+   if (YIELD && run.stage)
+      goto resume;
    for(;;){
       ++calcs;
       if(!(calcs & dumpPeriod)){
-         dumpState(currRow);
-         if(dumpFlag == DUMPSUCCESS) printf("State dumped to file %s%04d\n",DUMPROOT,dumpNum - 1);
-         else printf("Dump failed\n");
-         fflush(stdout);
-      }
-      if(currRow > longest || !(calcs & 0xffffff)){
-         if(currRow > longest){
-            buffPattern(currRow);
-            longest = currRow;
-            buffFlag = 1;
-            lastLong = calcs;
+         if ((lastError = dumpState(currRow)))
+            return SEARCH_ERROR;
+         sprintf(errbuf, "State dumped to file %s%04d", DUMPROOT, dumpNum - 1);
+         listener->message(*this, dumpFlag == DUMPSUCCESS ? errbuf : "Dump failed");
+      }
+      if(calcs > maxCalcs || (maxSeconds && !(calcs & 0xfffff) && time(0) >= stopTime)){
+         buffPattern(snapRows, snapRow);
+         listener->partial(*this, buf);
+         finish(SEARCH_LIMIT, totalShips, currRow - 2 * period);
+         listener->progress(*this, currRow - 2 * period, calcs, get_cpu_time() - ms);
+         return SEARCH_LIMIT;
+      }
+      if(currRow > longest){     // only remember the rows; they are rendered when shown
+         memcpy(snapRows, pRows, currRow * sizeof(*pRows));
+         snapRow = currRow;
+         longest = currRow;
+         buffFlag = 1;
+         lastLong = calcs;
+      }
+      if(!(calcs & 0xfffff)){
+         if(rt->failed){
+            lastError = rt->failed;
+            return SEARCH_ERROR;
+         }
+         if(reportPending || (reportInterval && time(0) >= nextReport)){
+            int demanded = reportPending;
+            reportPending = 0;
+            nextReport = time(0) + reportInterval;
+            buffPattern(snapRows, snapRow);
+            listener->partial(*this, buf);
+            listener->progress(*this, currRow - 2 * period, calcs, get_cpu_time() - ms);
+            if(demanded && profile >= 0) profileReport();
+            if(demanded) controlAt = 0;
+         }
+         if(relayoutAt && time(0) >= relayoutAt) relayout(currRow);
+         if(controlFile && time(0) >= controlAt && applyControl(currRow, totalShips) < 0){
+            finish(SEARCH_SHIPS, totalShips, currRow - 2 * period);
+            return SEARCH_SHIPS;
          }
-         if((buffFlag && calcs - lastLong > 0xffffff) || !(calcs & 0xffffffff)){
-            if(!(calcs & 0xffffffff)) buffPattern(currRow);
-            printPattern();
-            printInfo(currRow,calcs,get_cpu_time()-ms);
+         if(!(calcs & 0xffffff) && ((buffFlag && calcs - lastLong > 0xffffff) || !(calcs & 0xffffffff))){
+            if(!(calcs & 0xffffffff)){
+               memcpy(snapRows, pRows, currRow * sizeof(*pRows));
+               snapRow = currRow;
+            }
+            buffPattern(snapRows, snapRow);
+            listener->partial(*this, buf);
+            listener->progress(*this, currRow - 2 * period, calcs, get_cpu_time() - ms);
             buffFlag = 0;
          }
       }
       if(!pRemain[currRow]){
-         if(shipNum && lastNonempty[shipNum] == currRow) --shipNum;
+         if(shipNum && lastNonempty[shipNum] == (int)currRow) --shipNum;
          --currRow;
          if(phase == 0) phase = period;
          --phase;
-         if(sp[P_FULL_PERIOD] && firstFull == currRow) firstFull = 0;
-         if(currRow < 2 * sp[P_PERIOD]){
-            printPattern();
-            if(totalShips == 1)printf("Search complete: 1 spaceship found.\n");
-            else printf("Search complete: %d spaceships found.\n",totalShips);
-            printInfo(-1,calcs,get_cpu_time() - ms);
-            return;
+         if(sp[P_FULL_PERIOD] && firstFull == (int)currRow) firstFull = 0;
+         if((int)currRow < 2 * sp[P_PERIOD]){
+            if(rt->failed){
+               lastError = rt->failed;
+               return SEARCH_ERROR;
+            }
+            if(ldsUsed && ldsCut) goto yield;       //ldsSearch() makes another pass
+            buffPattern(snapRows, snapRow);
+            listener->partial(*this, buf);
+            finish(SEARCH_COMPLETE, totalShips, -1);
+            listener->progress(*this, -1, calcs, get_cpu_time() - ms);
+            return SEARCH_COMPLETE;
          }
          continue;
       }
       --pRemain[currRow];
-      pRows[currRow] = pInd[currRow][pRemain[currRow]];
+      pRows[currRow] = unfold(pMir[currRow], pInd[currRow][pRemain[currRow]]);
 #ifdef KNIGHT
       if (sp[P_X_OFFSET] && phase == sp[P_KNIGHT_PHASE] && pRows[currRow] & 1)
          continue ;
 #endif
-      if (currRow <= firstasymm) {
+      if ((int)currRow <= firstasymm) {
          int palin = checkPalindrome(pRows[currRow]) ;
          if (palin < 0)
             continue ;
@@ -808,15 +3125,38 @@ void search(){
          else
             firstasymm = currRow ;
       }
-      if(sp[P_MAX_LENGTH] && currRow > sp[P_MAX_LENGTH] + 2 * period - 1 && pRows[currRow] != 0) continue;  //back up if length exceeds max length
-      if(sp[P_FULL_PERIOD] && currRow > sp[P_FULL_PERIOD] && !firstFull && pRows[currRow]) continue;        //back up if not full period by certain length
+      if(sp[P_MAX_LENGTH] && (int)currRow > sp[P_MAX_LENGTH] + 2 * period - 1 && pRows[currRow] != 0) continue;  //back up if length exceeds max length
+      if(sp[P_FULL_PERIOD] && (int)currRow > sp[P_FULL_PERIOD] && !firstFull && pRows[currRow]) continue;        //back up if not full period by certain length
       if(sp[P_FULL_WIDTH] && (pRows[currRow] & fpBitmask)){
          if(equivRow[phase] < 0 && pRows[currRow] != pRows[currRow + equivRow[phase]]){
             if(!twoSubPeriods || (equivRow2[phase] < 0 && pRows[currRow] != pRows[currRow + equivRow2[phase]])) continue;
          }
       }
-      if(shipNum && currRow == lastNonempty[shipNum] + 2*period && !checkInteract(currRow)) continue;       //back up if new rows don't interact with ship
-      if(!lookAhead(currRow)) continue ;
+      if(shipNum && (int)currRow == lastNonempty[shipNum] + 2*period && !checkInteract(currRow)) continue;       //back up if new rows don't interact with ship
+      if(ldsUsed && ldsTaken[currRow] && pRows[currRow] && ldsUsed[currRow] >= ldsLimit){    //back up if one discrepancy too many
+         ldsCut = 1;
+         continue;
+      }
+      if (YIELD) {
+         prefetchAhead(currRow, 0) ;
+         run.stage = 1 ;
+         goto yield ;
+resume:
+         if (run.stage == 1) {
+            prefetchAhead(currRow, 1) ;
+            run.stage = 2 ;
+            goto yield ;
+         }
+         run.stage = 0 ;
+      }
+      int ok = lookAhead(currRow) ;
+      if (trace) traceQuery(currRow, ok) ;
+      if(!ok) continue ;
+      if(ldsUsed){         //any row but the first taken is a discrepancy, unless it is empty
+         ldsUsed[currRow + 1] = ldsUsed[currRow] + (ldsTaken[currRow] && pRows[currRow]);
+         ++ldsTaken[currRow];
+         ldsTaken[currRow + 1] = 0;
+      }
       if(sp[P_FULL_PERIOD] && !firstFull){
          if(equivRow[phase] < 0 && pRows[currRow] != pRows[currRow + equivRow[phase]]){
             if(!twoSubPeriods || (equivRow2[phase] < 0 && pRows[currRow] != pRows[currRow + equivRow2[phase]])) firstFull = currRow;
@@ -825,88 +3165,564 @@ void search(){
       ++currRow;
       ++phase;
       if(phase == period) phase = 0;
-      if(currRow > sp[P_DEPTH_LIMIT]){
+      if((int)currRow > sp[P_DEPTH_LIMIT]){
          noship = 0;
          for(j = 1; j <= 2 * period; ++j) noship |= pRows[currRow-j];
          if(!noship){
-            if(!sp[P_FULL_PERIOD] || firstFull){
-               printf("\n");
-               printPattern();
-               ++totalShips;
-               printf("Spaceship found. (%d)\n\n",totalShips);
-               printInfo(currRow,calcs,get_cpu_time() - ms);
-               --sp[P_NUM_SHIPS];
-               fflush(stdout) ;
+            if((!sp[P_FULL_PERIOD] || firstFull) && !(ldsUsed && ldsUsed[currRow] < ldsFloor)){     //shown by an earlier pass if below the floor
+               if(known && !known->add(shipKey(currRow))){
+                  ++knownShips;
+                  if(known->skip){     // back up to the ship's last row as if it had no tagalongs
+                     int last;
+                     for(last = currRow - 1; last > 0; --last) if(pRows[last]) break;
+                     while(shipNum && lastNonempty[shipNum] > last) --shipNum;
+                     if(firstFull >= last) firstFull = 0;
+                     currRow = last;
+                     phase = currRow % period;
+                     continue;
+                  }
+               } else {
+                  ++totalShips;
+                  buffPattern(snapRows, snapRow);
+                  listener->ship(*this, buf, totalShips);
+                  listener->progress(*this, currRow - 2 * period, calcs, get_cpu_time() - ms);
+                  if(--sp[P_NUM_SHIPS] == 0){     // only a new ship counts toward s
+                     finish(SEARCH_SHIPS, totalShips, currRow - 2 * period);
+                     return SEARCH_SHIPS;
+                  }
+               }
             }
             ++shipNum;
-            if(sp[P_NUM_SHIPS] == 0){
-               if(totalShips == 1)printf("Search terminated: spaceship found.\n");
-               else printf("Search terminated: %d spaceships found.\n",totalShips);
-               return;
-            }
             for(lastNonempty[shipNum] = currRow - 1; lastNonempty[shipNum] >= 0; --lastNonempty[shipNum]) if(pRows[lastNonempty[shipNum]]) break;
             currRow = lastNonempty[shipNum] + 2 * period;
             phase = currRow % period;
             longest = lastNonempty[shipNum];
             continue;
          }
-         else{
-            printPattern();
-            printf("Search terminated: depth limit reached.\n");
-            printf("Depth: %d\n", currRow - 2 * period);
-            if(totalShips == 1)printf("1 spaceship found.\n");
-            else printf("%d spaceships found.\n",totalShips);
+         if(rt->failed){
+            lastError = rt->failed;
+            return SEARCH_ERROR;
+         }
+         buffPattern(snapRows, snapRow);
+         listener->partial(*this, buf);
+         finish(SEARCH_DEPTH, totalShips, currRow - 2 * period);
+         listener->progress(*this, currRow - 2 * period, calcs, get_cpu_time() - ms);
+         return SEARCH_DEPTH;
+      }
+      getoffsetcount<1>(pRows[currRow - 2 * period],
+                     pRows[currRow - period],
+#ifdef KNIGHT
+                     pRows[currRow - period + backOff[phase]] >> kshiftb[phase],
+#else
+                     pRows[currRow - period + backOff[phase]],
+#endif
+                     pInd[currRow], pRemain[currRow], pMir[currRow]) ;
+   }
+yield:
+   run.currRow = currRow;
+   run.lastLong = lastLong;
+   run.totalShips = totalShips;
+   run.longest = longest;
+   run.buffFlag = buffFlag;
+   run.firstasymm = firstasymm;
+   return SEARCH_RUNNING;
+}
+
+/*
+ *   Limited-discrepancy search: search() made in passes over the same
+ *   tree, the first taking only the first row that passes the lookahead
+ *   at every level, the next allowing one other row anywhere on the
+ *   path, and so on up to ldsMax, then one pass with no limit, so the
+ *   search is still complete.  An empty row is never a discrepancy, so
+ *   a ship's run of empty rows to the depth limit costs nothing.  Each
+ *   pass repeats the ones before, so only ships with exactly as many
+ *   discrepancies as the pass allows (or more, in the last) are shown.
+ *   This pays when the search order is usually right: a ship that one
+ *   early wrong turn hides from search() is found in the second pass.
+ */
+int Searcher::ldsSearch(){
+   if (queuemem > 0) {
+      lastError = "Limited-discrepancy search can't be combined with --queue" ;
+      return SEARCH_ERROR ;
+   }
+   ldsUsed = (int *)calloc(2 + sp[P_DEPTH_LIMIT], sizeof(int)) ;
+   ldsTaken = (int *)calloc(2 + sp[P_DEPTH_LIMIT], sizeof(int)) ;
+   beginSearch() ;
+   int result = SEARCH_RUNNING ;
+   for (int pass=0; result == SEARCH_RUNNING; pass++) {
+      ldsLimit = pass <= ldsMax ? pass : 0x7fffffff ;
+      ldsFloor = pass ;
+      ldsCut = 0 ;
+      ldsUsed[rowNum] = ldsTaken[rowNum] = 0 ;
+      // the first row's list as start() found it; relayout() may have moved it
+      if (sp[P_INIT_ROWS]) {
+         getoffsetcount<1>(pRows[0], pRows[period], pRows[period+backOff[0]],
+                           pInd[rowNum], pRemain[rowNum], pMir[rowNum]) ;
+      } else {
+         getoffsetcount(0, 0, 0, pInd[rowNum], pRemain[rowNum]) ;
+         pRemain[rowNum]-- ;
+         pMir[rowNum] = 0 ;
+      }
+      shipNum = firstFull = 0 ;
+      run.currRow = rowNum ;
+      phase = rowNum % period ;
+      run.firstasymm = sp[P_SYMMETRY] == SYM_ASYM && sp[P_X_OFFSET] == 0 ? rowNum : 0 ;
+      unsigned long long before = calcs ;
+      result = searchLoop<0>() ;
+      if (result == SEARCH_RUNNING) {
+         sprintf(errbuf, "Discrepancy pass %d: %llu calculations, %d ships so far",
+                 pass, calcs - before, run.totalShips) ;
+         listener->message(*this, errbuf) ;
+      }
+   }
+   free(ldsUsed) ;
+   free(ldsTaken) ;
+   ldsUsed = ldsTaken = 0 ;
+   return result ;
+}
+
+/*
+ *   The hybrid engine: breadth-first, one level per row, with every open
+ *   partial kept in queue[] as its last row and its parent's index, so a
+ *   partial costs a few bytes however long it is.  Partials at the same
+ *   level whose last qspan rows (all that lookAhead() reads, 2*period or
+ *   more when the offset is above 1) agree have the same futures and
+ *   only the first is kept.  When the queue fills, each partial at the
+ *   frontier is searched depth-first a few rows ahead and those that die
+ *   are dropped along with the ancestors nothing else needs; if too
+ *   little comes free the probes go deeper, and once they would pass the
+ *   depth limit the frontier is finished off depth-first.  This finds
+ *   the shortest ships first, where search() finds the first ones in its
+ *   own order.
+ */
+int Searcher::hybridSearch(){
+   int result = hybridLoop() ;
+   if (result != SEARCH_ERROR) {
+      sprintf(errbuf, "Hybrid search: queue peak %u of %lld nodes, %llu duplicates, %llu prunes (probing %d rows)",
+              qpeak, qcap, qdups, qprunes, qprobeRows) ;
+      listener->message(*this, errbuf) ;
+   }
+   return result ;
+}
+
+// the checks search() makes on pRows[a] before the lookahead; palin is
+// 1 while every row before it has been a palindrome, and is updated
+int Searcher::rowOk(int a, int &palin){
+   row_t row = pRows[a] ;
+#ifdef KNIGHT
+   if (sp[P_X_OFFSET] && phase == sp[P_KNIGHT_PHASE] && row & 1)
+      return 0 ;
+#endif
+   if (palin) {
+      int t = checkPalindrome(row) ;
+      if (t < 0)
+         return 0 ;
+      palin = t == 0 ;
+   }
+   if(sp[P_MAX_LENGTH] && a > sp[P_MAX_LENGTH] + 2 * period - 1 && row != 0) return 0;
+   if(sp[P_FULL_WIDTH] && (row & fpBitmask)){
+      if(equivRow[phase] < 0 && row != pRows[a + equivRow[phase]]){
+         if(!twoSubPeriods || (equivRow2[phase] < 0 && row != pRows[a + equivRow2[phase]])) return 0;
+      }
+   }
+   return 1 ;
+}
+
+// the qspan rows before row a, from node back; lookAhead() reads the
+// stack's rows through pInd, and rowSelf keeps its cache keys distinct
+void Searcher::qwindow(uint32_t node, int a){
+   for (int x=a-1; x>=a-qspan && x>=2*period; x--) {
+      pRows[x] = queue[node].row ;
+      pInd[x] = rowSelf ;
+      pRemain[x] = pRows[x] ;
+      pMir[x] = 0 ;
+      node = queue[node].parent & QINDEX ;
+   }
+}
+
+// every row before row a, from node back, for showing the pattern
+void Searcher::qpath(uint32_t node, int a){
+   for (int x=a-1; x>=2*period; x--) {
+      pRows[x] = queue[node].row ;
+      node = queue[node].parent & QINDEX ;
+   }
+}
+
+uint32_t Searcher::qhashRows(int a, int palin){
+   uint64_t h = palin ;
+   for (int x=a; x>a-qspan && x>=2*period; x--)
+      h = (h + pRows[x]) * 0x9e3779b97f4a7c15ULL ;
+   return (uint32_t)(h >> 32) ;
+}
+
+// whether node, a child ending in row a, ends in the same rows as pRows
+int Searcher::qsame(uint32_t node, int a, int palin){
+   if ((int)(queue[node].parent >> 31) != palin)
+      return 0 ;
+   for (int x=a; x>a-qspan && x>=2*period; x--) {
+      if (queue[node].row != pRows[x])
+         return 0 ;
+      node = queue[node].parent & QINDEX ;
+   }
+   return 1 ;
+}
+
+// a ship ending at row end - 1, with every row in pRows
+int Searcher::qship(int end){
+   if (known && !known->add(shipKey(end))) {
+      ++knownShips ;
+      return SEARCH_RUNNING ;
+   }
+   ++run.totalShips ;
+   buffPattern(pRows, end) ;
+   listener->ship(*this, buf, run.totalShips) ;
+   listener->progress(*this, end - 2 * period, calcs, get_cpu_time() - run.ms) ;
+   if (--sp[P_NUM_SHIPS] == 0) {
+      finish(SEARCH_SHIPS, run.totalShips, end - 2 * period) ;
+      return SEARCH_SHIPS ;
+   }
+   return SEARCH_RUNNING ;
+}
+
+// search()'s periodic checks and reports, for row a below node (whose
+// children start at row d)
+int Searcher::qtick(uint32_t node, int d, int a){
+   if ((calcs & 0xfffff) && calcs <= maxCalcs)
+      return SEARCH_RUNNING ;
+   if (rt->failed) {
+      lastError = rt->failed ;
+      return SEARCH_ERROR ;
+   }
+   int limit = calcs > maxCalcs || (maxSeconds && time(0) >= run.stopTime) ;
+   if (limit || reportPending || (reportInterval && time(0) >= run.nextReport)) {
+      int demanded = reportPending ;
+      reportPending = 0 ;
+      run.nextReport = time(0) + reportInterval ;
+      qpath(node, d) ;
+      buffPattern(pRows, a) ;
+      listener->partial(*this, buf) ;
+      if (limit)
+         finish(SEARCH_LIMIT, run.totalShips, a - 2 * period) ;
+      listener->progress(*this, a - 2 * period, calcs, get_cpu_time() - run.ms) ;
+      if (demanded && profile >= 0)
+         profileReport() ;
+   }
+   return limit ? SEARCH_LIMIT : SEARCH_RUNNING ;
+}
+
+/*
+ *   Depth-first below node, whose rows are in place up to row a, until
+ *   some row limit - 1 passes: 1 if one does (qreach is then set), 0 if
+ *   every branch dies first.  A ship counts as passing unless report is
+ *   set, when it is reported and ends only its branch; result is set if
+ *   the search should stop.
+ */
+int Searcher::qprobe(uint32_t node, int a, int limit, int report, int &result){
+   int d = a ;
+   qpal[a] = queue[node].parent >> 31 ;
+   phase = a % period ;
+   getoffsetcount<1>(pRows[a - 2 * period],
+                     pRows[a - period],
+#ifdef KNIGHT
+                     pRows[a - period + backOff[phase]] >> kshiftb[phase],
+#else
+                     pRows[a - period + backOff[phase]],
+#endif
+                     pInd[a], pRemain[a], pMir[a]) ;
+   if (a == 2 * period && !sp[P_INIT_ROWS])
+      --pRemain[a] ;         // not the empty row
+   for (;;) {
+      ++calcs ;
+      if ((result = qtick(node, d, a)) != SEARCH_RUNNING)
+         return 0 ;
+      if (!pRemain[a]) {
+         if (a == d)
+            return 0 ;
+         --a ;
+         phase = a % period ;
+         continue ;
+      }
+      --pRemain[a] ;
+      pRows[a] = unfold(pMir[a], pInd[a][pRemain[a]]) ;
+      int palin = qpal[a] ;
+      if (!rowOk(a, palin) || !lookAhead(a))
+         continue ;
+      int j ;
+      for (j=0; j<2*period && pRows[a-j]==0; j++) ;
+      if (j == 2 * period) {
+         if (!report) {
+            qreach = a ;
+            return 1 ;
+         }
+         if (a == d && qskip > 0) {
+            --qskip ;
+            continue ;
          }
-         printInfo(currRow,calcs,get_cpu_time() - ms);
-         return;
+         qpath(node, d) ;
+         if ((result = qship(a + 1)) != SEARCH_RUNNING)
+            return 0 ;
+         continue ;
       }
-      getoffsetcount(pRows[currRow - 2 * period],
-                     pRows[currRow - period],
+      if (a + 1 >= limit) {
+         qreach = a ;
+         return 1 ;
+      }
+      ++a ;
+      phase = a % period ;
+      qpal[a] = palin ;
+      getoffsetcount<1>(pRows[a - 2 * period],
+                        pRows[a - period],
 #ifdef KNIGHT
-                     pRows[currRow - period + backOff[phase]] >> kshiftb[phase],
+                        pRows[a - period + backOff[phase]] >> kshiftb[phase],
 #else
-                     pRows[currRow - period + backOff[phase]],
+                        pRows[a - period + backOff[phase]],
 #endif
-                     pInd[currRow], pRemain[currRow]) ;
+                        pInd[a], pRemain[a], pMir[a]) ;
    }
 }
 
-char * loadFile;
+/*
+ *   Drop the frontier's dead nodes (parent QDEAD) and every node none of
+ *   the rest descend from, and close up the queue.  Parents come before
+ *   their children, so one pass each way does it; qhash is free between
+ *   levels and holds the marks, then the new indices.
+ */
+void Searcher::qcollect(std::vector<uint32_t> &level, uint32_t &qsize){
+   uint32_t lo = level[level.size() - 2] ;
+   memset(qhash, 0, qsize * sizeof(*qhash)) ;
+   for (uint32_t j=lo; j<qsize; j++)
+      qhash[j] = queue[j].parent != QDEAD ;
+   for (uint32_t j=qsize-1; j>0; j--)
+      if (qhash[j])
+         qhash[queue[j].parent & QINDEX] = 1 ;
+   uint32_t n = 0 ;
+   size_t l = 1 ;
+   for (uint32_t j=0; j<qsize; j++) {
+      while (l < level.size() && level[l] == j)
+         level[l++] = n ;
+      if (!qhash[j])
+         continue ;
+      qhash[j] = n ;
+      queue[n].row = queue[j].row ;
+      queue[n].parent = j == 0 ? queue[j].parent :
+         (queue[j].parent & QPALIN) | qhash[queue[j].parent & QINDEX] ;
+      n++ ;
+   }
+   while (l < level.size())
+      level[l++] = n ;
+   qsize = n ;
+   memset(qhash, 0, (qmask + 1) * sizeof(*qhash)) ;
+}
 
-void loadFail(){
-   printf("Load from file %s failed\n",loadFile);
-   exit(1);
+int Searcher::hybridLoop(){
+   if (sp[P_FULL_PERIOD]) {
+      lastError = "The breadth-first search doesn't support f" ;
+      return SEARCH_ERROR ;
+   }
+   // each node takes its slot and two in qhash
+   if (queue == 0) {
+      long long slots = 1024 ;
+      while (8 * 2 * slots <= (long long)queuemem << 20 && slots < 0x40000000)
+         slots <<= 1 ;
+      qmask = slots - 1 ;
+      qcap = slots / 2 ;
+      queue = (qnode *)malloc(qcap * sizeof(qnode)) ;
+      qhash = (uint32_t *)calloc(slots, sizeof(uint32_t)) ;
+      rowSelf = (row_t *)malloc(sizeof(row_t) << width) ;
+      if (queue == 0 || qhash == 0 || rowSelf == 0) {
+         lastError = "Not enough memory for the queue" ;
+         return SEARCH_ERROR ;
+      }
+      for (int r=0; r<(1<<width); r++)
+         rowSelf[r] = r ;
+      rt->addUsage(qcap * sizeof(qnode) + slots * sizeof(uint32_t)) ;
+   }
+   qpal.assign(1 + sp[P_DEPTH_LIMIT], 0) ;
+   calcs = 0 ;
+   run.totalShips = 0 ;
+   run.ms = get_cpu_time() ;
+   run.nextReport = time(0) + reportInterval ;
+   run.stopTime = time(0) + maxSeconds ;
+   int p2 = 2 * period ;
+   // lookAhead() at row a reads back to a - period - doubleOff and
+   // a - period - tripleOff (or a - tripleOff, if that is period or
+   // more), and the full period checks to a + equivRow
+   qspan = p2 ;
+   for (int i=0; i<period; i++) {
+      int back = period + std::max(doubleOff[i], tripleOff[i] < period ? tripleOff[i] : 0) ;
+      back = std::max(back, tripleOff[i]) ;
+      back = std::max(back, std::max(-equivRow[i], -equivRow2[i])) ;
+      if (back > qspan)
+         qspan = back ;
+   }
+   queue[0].row = 0 ;
+   queue[0].parent = QINDEX ;
+   if (sp[P_SYMMETRY] == SYM_ASYM && sp[P_X_OFFSET] == 0)
+      queue[0].parent |= QPALIN ;
+   uint32_t qsize = 1 ;
+   qpeak = 1 ;
+   std::vector<uint32_t> level ;   // where each level starts, then the end
+   level.push_back(0) ;
+   level.push_back(1) ;
+   qprobeRows = p2 ;
+   int result ;
+   int shipsHere = 0 ;      // ships found building this level, in case it's built again
+   int skipShips = 0 ;
+   for (int L=0; ; L++) {
+      int a = p2 + L ;       // the row this level's children end in
+      uint32_t lo = level[L], hi = level[L+1] ;
+      if (lo == hi) {
+         if(rt->failed){
+            lastError = rt->failed;
+            return SEARCH_ERROR;
+         }
+         finish(SEARCH_COMPLETE, run.totalShips, -1) ;
+         listener->progress(*this, -1, calcs, get_cpu_time() - run.ms) ;
+         return SEARCH_COMPLETE ;
+      }
+      if (a > sp[P_DEPTH_LIMIT]) {
+         qpath(lo, a) ;
+         buffPattern(pRows, a) ;
+         listener->partial(*this, buf) ;
+         finish(SEARCH_DEPTH, run.totalShips, a - p2) ;
+         listener->progress(*this, a - p2, calcs, get_cpu_time() - run.ms) ;
+         return SEARCH_DEPTH ;
+      }
+      uint32_t i ;
+      int full = 0 ;
+      for (i=lo; i<hi && !full; i++) {
+         int palin0 = queue[i].parent >> 31 ;
+         row_t *p ;
+         int n ;
+         unsigned char m ;
+         qwindow(i, a) ;
+         phase = a % period ;
+         getoffsetcount<1>(pRows[a - p2],
+                           pRows[a - period],
+#ifdef KNIGHT
+                           pRows[a - period + backOff[phase]] >> kshiftb[phase],
+#else
+                           pRows[a - period + backOff[phase]],
+#endif
+                           p, n, m) ;
+         if (a == p2 && !sp[P_INIT_ROWS])
+            --n ;            // not the empty row
+         while (n > 0) {     // in the order search() tries them
+            ++calcs ;
+            if ((result = qtick(i, a, a)) != SEARCH_RUNNING)
+               return result ;
+            pRows[a] = unfold(m, p[--n]) ;
+            int palin = palin0 ;
+            if (!rowOk(a, palin))
+               continue ;
+            pInd[a] = rowSelf ;
+            pRemain[a] = pRows[a] ;
+            pMir[a] = 0 ;
+            if (!lookAhead(a))
+               continue ;
+            int j ;
+            for (j=0; j<p2 && pRows[a-j]==0; j++) ;
+            if (j == p2) {
+               if (++shipsHere <= skipShips)
+                  continue ;
+               qpath(i, a) ;
+               if ((result = qship(a + 1)) != SEARCH_RUNNING)
+                  return result ;
+               continue ;
+            }
+            uint32_t h = qhashRows(a, palin) & qmask, v ;
+            while ((v = qhash[h]) >= hi && v < qsize && !qsame(v, a, palin))
+               h = (h + 1) & qmask ;
+            if (v >= hi && v < qsize) {
+               ++qdups ;
+               continue ;
+            }
+            if (qsize == qcap) {
+               full = 1 ;
+               break ;
+            }
+            queue[qsize].row = pRows[a] ;
+            queue[qsize].parent = i | (palin ? QPALIN : 0) ;
+            qhash[h] = qsize++ ;
+         }
+      }
+      if (qsize > qpeak)
+         qpeak = qsize ;
+      if (!full) {
+         level.push_back(qsize) ;
+         shipsHere = skipShips = 0 ;
+         continue ;
+      }
+      // the queue is full: take back the level so far and prune the
+      // frontier; the ships already found are found again, so skip them
+      qsize = hi ;
+      skipShips = shipsHere ;
+      shipsHere = 0 ;
+      memset(qhash, 0, (qmask + 1) * sizeof(*qhash)) ;
+      for (;;) {
+         int limit = a + qprobeRows ;
+         int last = limit > sp[P_DEPTH_LIMIT] ;
+         if (last)
+            limit = sp[P_DEPTH_LIMIT] + 1 ;
+         ++qprunes ;
+         qskip = skipShips ;
+         for (uint32_t j=lo; j<hi; j++) {
+            if (queue[j].parent == QDEAD)
+               continue ;
+            qwindow(j, a) ;
+            int alive = qprobe(j, a, limit, last, result) ;
+            if (result != SEARCH_RUNNING)
+               return result ;
+            if (alive && last) {
+               qpath(j, a) ;
+               buffPattern(pRows, qreach + 1) ;
+               listener->partial(*this, buf) ;
+               finish(SEARCH_DEPTH, run.totalShips, qreach + 1 - p2) ;
+               listener->progress(*this, qreach + 1 - p2, calcs, get_cpu_time() - run.ms) ;
+               return SEARCH_DEPTH ;
+            }
+            if (!alive)
+               queue[j].parent = QDEAD ;
+         }
+         qcollect(level, qsize) ;
+         lo = level[L] ;
+         hi = level[L+1] ;
+         if (last || 2 * (long long)qsize <= qcap)
+            break ;
+         qprobeRows *= 2 ;   // not enough came free: look further ahead
+      }
+      L-- ;                  // and build the level again
+   }
 }
 
-signed int loadInt(FILE *fp){
+signed int Searcher::loadInt(FILE *fp){
    signed int v;
-   if (fscanf(fp,"%d\n",&v) != 1) loadFail();
+   if (fscanf(fp,"%d\n",&v) != 1) loadFailed = 1;
    return v;
 }
 
-long long loadUL(FILE *fp){
+long long Searcher::loadUL(FILE *fp){
    long long v;
-   if (fscanf(fp,"%lld\n",&v) != 1) loadFail();
+   if (fscanf(fp,"%lld\n",&v) != 1) loadFailed = 1;
    return v;
 }
 
-void loadState(char * cmd, char * file){
-   printf("Loading state not supported at the moment.\n") ;
-   exit(10) ;
+const char *Searcher::loadState(const char * cmd, const char * file){
+   return "Loading state not supported at the moment." ;
    FILE * fp;
    int i;
-   
-   printf("Loading search state from %s\n",file);
-   
-   loadFile = file;
-   fp = fopen(loadFile, "r");
-   if (!fp) loadFail();
+
+   listener->message(*this, "Loading search state");
+
+   sprintf(errbuf, "Load from file %.200s failed", file);
+   fp = fopen(file, "r");
+   if (!fp) return errbuf;
    if (loadUL(fp) != FILEVERSION)
    {
-      printf("Incompatible file version\n");
-      exit(1);
+      fclose(fp);
+      return "Incompatible file version";
    }
-   
+
    /* Load parameters and set stuff that can be derived from them */
    for (i = 0; i < NUM_PARAMS; i++)
       sp[i] = loadInt(fp);
@@ -917,12 +3733,12 @@ void loadState(char * cmd, char * file){
    for (i = 1; i <= shipNum; i++)
       lastNonempty[i] = loadUL(fp);
    rowNum = loadInt(fp);
-   
+
    if(sp[P_DUMP] > 0){
       if(sp[P_DUMP] < MIN_DUMP) sp[P_DUMP] = MIN_DUMP;
       dumpPeriod = ((long long)1 << sp[P_DUMP]) - 1;
    }
-   
+
    width = sp[P_WIDTH];
    period = sp[P_PERIOD];
    offset = sp[P_OFFSET];
@@ -935,48 +3751,83 @@ void loadState(char * cmd, char * file){
    }
    if (sp[P_X_OFFSET]) sp[P_SYMMETRY] = SYM_ASYM ;
    sp[P_KNIGHT_PHASE] %= period ;
-   
-   pRows = (uint16_t *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(uint16_t));
-   pInd = (uint16_t **)calloc(1+sp[P_DEPTH_LIMIT], sizeof(uint16_t *));
+
+   pRows = (row_t *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(row_t));
+   pInd = (row_t **)calloc(1+sp[P_DEPTH_LIMIT], sizeof(row_t *));
    pRemain = (int *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(int));
-   
+   pMir = (unsigned char *)calloc(1+sp[P_DEPTH_LIMIT], 1);
+
    for (i = 0; i < 2 * period; i++)
-      pRows[i] = (uint16_t) loadUL(fp);
+      pRows[i] = (row_t) loadUL(fp);
    for (i = 2 * period; i <= rowNum; i++){
-      pRows[i]   = (uint16_t) loadUL(fp);
+      pRows[i]   = (row_t) loadUL(fp);
 // broken      pInd[i]    = loadUL(fp) + gInd2 ;
       pRemain[i] = (uint32_t) loadUL(fp);
    }
    fclose(fp);
-   
+   if (loadFailed) return errbuf;
+
    if(!strcmp(cmd,"p") || !strcmp(cmd,"P")){
-      buffPattern(rowNum);
-      printPattern();
-      exit(0);
+      buf = (char *)calloc((2*sp[P_WIDTH] + 4), sp[P_DEPTH_LIMIT]);
+      buffPattern(pRows, rowNum);
+      listener->partial(*this, buf);
+   }
+   return 0;
+}
+
+// a row as written in an initial rows file: width cells, '.' for empty
+row_t parseRow(const char *rowStr, int width){
+   row_t r = 0;
+   for(int j = 0; j < width; j++){
+      r |= ((rowStr[width - j - 1] == '.') ? 0:1) << j;
    }
+   return r;
 }
 
-void loadInitRows(char * file){
+const char *Searcher::loadInitRows(const char * file){
    FILE * fp;
-   int i,j;
-   char rowStr[MAXWIDTH];
-   
-   loadFile = file;
-   fp = fopen(loadFile, "r");
-   if (!fp) loadFail();
-   
+   int i;
+   char rowStr[256];
+
+   sprintf(errbuf, "Load from file %.200s failed", file);
+   fp = fopen(file, "r");
+   if (!fp) return errbuf;
+
    for(i = 0; i < 2 * period; i++){
-      if (fscanf(fp,"%s",rowStr) != 1)
-         error("! early end on file when reading initial rows") ;
-      for(j = 0; j < width; j++){
-         pRows[i] |= ((rowStr[width - j - 1] == '.') ? 0:1) << j;
+      if (fscanf(fp,"%255s",rowStr) != 1) {
+         fclose(fp);
+         return "! early end on file when reading initial rows" ;
       }
+      pRows[i] |= parseRow(rowStr, width);
    }
    fclose(fp);
+   return 0;
+}
+
+/*
+ *   Use these 2*period rows as the initial rows, as the e option does
+ *   with a file.  Call between init() and start().
+ */
+void Searcher::setInitRows(const row_t *rows){
+   memcpy(pRows, rows, 2 * period * sizeof(*pRows));
+   sp[P_INIT_ROWS] = 1;
 }
 
-void initializeSearch(char * file){
+/*
+ *   Take the parameters (indexed by P_*), normalize them and set up the
+ *   search stack and phase tables.  The rule table is not touched yet.
+ */
+const char *Searcher::init(const int *params, const char * file){
    int i;
+   for (i = 0; i < NUM_PARAMS; i++)
+      sp[i] = userParams[i] = params[i];
+   if (sp[P_X_OFFSET]) sp[P_SYMMETRY] = SYM_ASYM ;
+   if(!sp[P_WIDTH] || !sp[P_PERIOD] || !sp[P_OFFSET] || !sp[P_SYMMETRY])
+      return "You must specify a width, period, offset, and symmetry type.";
+   if(sp[P_PERIOD] > MAXPERIOD)
+      return "Period too large";
+   if(sp[P_WIDTH] > MAXROWBITS)
+      return "Width too large for this build";
    if(sp[P_DUMP] > 0){
       if(sp[P_DUMP] < MIN_DUMP) sp[P_DUMP] = MIN_DUMP;
       dumpPeriod = ((long long)1 << sp[P_DUMP]) - 1;
@@ -996,19 +3847,296 @@ void initializeSearch(char * file){
    }
    if (sp[P_X_OFFSET]) sp[P_SYMMETRY] = SYM_ASYM ;
    sp[P_KNIGHT_PHASE] %= period ;
-   
-   pRows = (uint16_t *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(uint16_t));
-   pInd = (uint16_t **)calloc(1+sp[P_DEPTH_LIMIT], sizeof(uint16_t *));
+
+   pRows = (row_t *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(row_t));
+   pInd = (row_t **)calloc(1+sp[P_DEPTH_LIMIT], sizeof(row_t *));
    pRemain = (int *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(int));
+   pMir = (unsigned char *)calloc(1+sp[P_DEPTH_LIMIT], 1);
+   snapRows = (row_t *)calloc(1+sp[P_DEPTH_LIMIT], sizeof(row_t));
    lastNonempty = (int *)calloc(sizeof(int), (sp[P_DEPTH_LIMIT]/10));
    rowNum = 2 * period;
    for(i = 0; i < 2 * period; i++)pRows[i] = 0;
-   if(sp[P_INIT_ROWS]) loadInitRows(file);
+   if(sp[P_INIT_ROWS]){
+      const char *err = loadInitRows(file);
+      if (err) return err;
+   }
+   makePhases();                    //make phase tables for determining successor row indices
+   if(gcd(period,offset) > 1){      //make phase tables for determining equivalent subperiodic rows
+      int div1 = smallestDivisor(gcd(period,offset));
+      makeEqRows(period / div1,1);
+      int div2 = gcd(period,offset);
+      while(div2 % div1 == 0) div2 /= div1;
+      if(div2 != 1){
+         twoSubPeriods = 1;
+         div2 = smallestDivisor(div2);
+         makeEqRows(period / div2,2);
+      }
+   }
+#ifdef KNIGHT
+   if (sp[P_X_OFFSET])
+      makekshift(sp[P_KNIGHT_PHASE]) ;
+#endif
+   return 0;
+}
+
+/*
+ *   Build (or attach to) the rule table, allocate the lookahead cache and
+ *   seed the search stack.
+ */
+const char *Searcher::start(){
+   if (cachemem < 0 && !rt->built) {
+      const char *err = plan(rt->memlimit) ;
+      if (err)
+         return err ;
+   }
+   int wasBuilt = rt->built ;
+   const char *err = rt->build(width, sp[P_SYMMETRY], sp[P_REORDER]) ;
+   if (err)
+      return err ;
+   if (!wasBuilt) {
+      char stats[200] ;
+      sprintf(errbuf, "Table setup: %f seconds (%d threads%s); %s", rt->buildTime,
+              rt->threads, rt->eager ? ", eager" : "", rt->listStats(stats)) ;
+      listener->message(*this, errbuf) ;
+   }
+   if (cachesize == 0) {
+      cachesize = 32768 ;
+      while (cachesize * (long long)sizeof(cacheentry) < 550000 * (long long)cachemem)
+         cachesize <<= 1 ;
+   }
+   long long bytes = sizeof(cacheentry) * cachesize ;
+   cache = (cacheentry *)calloc(sizeof(cacheentry), cachesize) ;
+   if (memomem > 0 && memo == 0) {
+      memosize = 4096 ;
+      while (2 * memosize * (long long)sizeof(memoentry) <= (long long)memomem << 20)
+         memosize <<= 1 ;
+      bytes += sizeof(memoentry) * memosize ;
+      memo = (memoentry *)calloc(sizeof(memoentry), memosize) ;
+   }
+   rt->addUsage(bytes) ;
+   gInd3 = rt->gInd3 ;
+   compact = rt->compact ;
+   mapWords = rt->mapWords ;
+   fold = rt->fold ;
+   revRow = rt->revRow ;
+   row_t *zeroRows ;
+   int numZero ;
+   getoffsetcount(0, 0, 0, zeroRows, numZero) ;
+   for (int i=0; i<sp[P_DEPTH_LIMIT]; i++) {
+      pInd[i] = zeroRows ;
+      pRemain[i] = 0 ;
+      pMir[i] = 0 ;
+   }
+   pRemain[2 * period] = numZero - 1 ;
+   pInd[2 * period] = zeroRows ;
+   if(sp[P_INIT_ROWS]){
+      getoffsetcount<1>(pRows[0], pRows[period], pRows[period+backOff[0]],
+                        pInd[2*period], pRemain[2*period], pMir[2*period]) ;
+   }
+   buf = (char *)calloc((2*sp[P_WIDTH] + 4), sp[P_DEPTH_LIMIT]);  // I think this gives more than enough space
+   buf[0] = '\0';
+   return 0;
+}
+
+/*
+ *   Report what the run is expected to need before anything big is
+ *   allocated, and choose the largest power-of-two lookahead cache that
+ *   still fits in budget.  The cache is used by the following start().
+ */
+const char *Searcher::plan(long long budget){
+   TablePlan tp ;
+   const char *err = rt->plan(width, sp[P_SYMMETRY], tp) ;
+   if (err)
+      return err ;
+   long long depth = 1 + sp[P_DEPTH_LIMIT] ;
+   long long stack = depth * (3 * sizeof(row_t) + sizeof(row_t *) + sizeof(int)) +
+                     depth * (2 * width + 4) + sizeof(int) * depth / 10 ;
+   long long fixed = tp.indexBytes + tp.arenaBytes + stack ;
+   cachesize = 32768 ;
+   if (budget >= 0x7000000000000000LL)       // no limit given; use the C size
+      while (cachesize * (long long)sizeof(cacheentry) < 550000 * (long long)(cachemem < 0 ? 32 : cachemem))
+         cachesize <<= 1 ;
+   else
+      while (fixed + 2 * cachesize * (long long)sizeof(cacheentry) <= budget)
+         cachesize <<= 1 ;
+   long long cacheBytes = cachesize * (long long)sizeof(cacheentry) ;
+   listener->message(*this, "Memory plan:") ;
+   sprintf(errbuf, "  index (gInd3, ev2Rows, gcount, list index): %lld MB", tp.indexBytes >> 20) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "  successor arena, full table: %lld MB (%s%lld distinct lists of %.0f entries, %s %d pairs)",
+           tp.arenaBytes >> 20, tp.exact ? "" : "at least ", tp.lists, tp.avgLen,
+           tp.exact ? "from all" : "estimated from", tp.samples) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "  search stack: %lld MB", stack >> 20) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "  lookahead cache: %lld MB (%lld entries)", cacheBytes >> 20, cachesize) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "  total: %lld MB", (fixed + cacheBytes) >> 20) ;
+   listener->message(*this, errbuf) ;
+   if (fixed + cacheBytes > budget)
+      listener->message(*this, "  (this is more than the memory limit; a lazy search may still fit)") ;
+   return 0 ;
+}
+
+/*
+ *   Query traces.  A trace records every lookAhead() call search() makes
+ *   so the same query stream can later be run against changed kernels.
+ *   The file starts with "NTZT", a version, the parameters, the rule and
+ *   the initial rows.  Each query is then one byte, holding the
+ *   lookAhead() result in bit 0 and the change in row index plus 64
+ *   above it (or 0 followed by the absolute index as an int if the
+ *   change is out of range), and the row being tried as a uint16_t.
+ *   Everything is in host byte order, so a trace is for the machine
+ *   type that made it.
+ *   Rows below the query row are those of the latest query at each
+ *   index, which is all search() itself depends on.
+ */
+#define TRACEVERSION 1
+const char *Searcher::startTrace(const char *file){
+   trace = fopen(file, "wb") ;
+   if (trace == 0)
+      return "Could not open trace file" ;
+   setvbuf(trace, 0, _IOFBF, 1 << 20) ;
+   int v = TRACEVERSION, n = NUM_PARAMS, len = strlen(rt->rule) ;
+   fwrite("NTZT", 1, 4, trace) ;
+   fwrite(&v, sizeof(v), 1, trace) ;
+   fwrite(&n, sizeof(n), 1, trace) ;
+   fwrite(userParams, sizeof(int), NUM_PARAMS, trace) ;
+   fwrite(&len, sizeof(len), 1, trace) ;
+   fwrite(rt->rule, 1, len, trace) ;
+   for (int i=0; i<2*period; i++) {
+      uint16_t r = pRows[i] ;
+      fwrite(&r, sizeof(r), 1, trace) ;
+   }
+   traceA = 0 ;
+   return 0 ;
+}
+
+void Searcher::traceQuery(int a, int result){
+   int d = a - traceA ;
+   if (d > -64 && d < 64) {
+      putc(((d + 64) << 1) | result, trace) ;
+   } else {
+      putc(result, trace) ;
+      fwrite(&a, sizeof(a), 1, trace) ;
+   }
+   uint16_t r = pRows[a] ;
+   fwrite(&r, sizeof(r), 1, trace) ;
+   traceA = a ;
+}
+
+/*
+ *   Run the queries in a trace against the current tables and lookahead
+ *   on a freshly set up Searcher (init() not yet called) and report the
+ *   time per query, the cache hit rate and any result that differs from
+ *   the recorded one.  The stack is rebuilt the way search() builds it,
+ *   so the cost of descending is included in the timing.
+ */
+const char *Searcher::replay(const char *file){
+   FILE *fp = fopen(file, "rb") ;
+   if (fp == 0)
+      return "Could not open trace file" ;
+   char magic[4] ;
+   int v = 0, n = 0, len = 0, params[NUM_PARAMS] ;
+   char rule[256] ;
+   if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, "NTZT", 4) != 0 ||
+       fread(&v, sizeof(v), 1, fp) != 1 || v != TRACEVERSION ||
+       fread(&n, sizeof(n), 1, fp) != 1 || n != NUM_PARAMS ||
+       fread(params, sizeof(int), NUM_PARAMS, fp) != NUM_PARAMS ||
+       fread(&len, sizeof(len), 1, fp) != 1 || len < 0 || len >= 256 ||
+       fread(rule, 1, len, fp) != (size_t)len) {
+      fclose(fp) ;
+      return "Not a trace file, or from an incompatible version" ;
+   }
+   rule[len] = 0 ;
+   const char *err = rt->setRule(rule) ;
+   params[P_INIT_ROWS] = 0 ;
+   if (err == 0)
+      err = init(params, 0) ;
+   for (int i=0; err == 0 && i<2*period; i++) {
+      uint16_t r ;
+      if (fread(&r, sizeof(r), 1, fp) != 1)
+         err = "Trace file truncated" ;
+      pRows[i] = r ;
+   }
+   if (err == 0)
+      err = start() ;
+   if (err) {
+      fclose(fp) ;
+      return err ;
+   }
+   std::vector<unsigned char> q ;
+   unsigned char chunk[1 << 16] ;
+   size_t got ;
+   while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+      q.insert(q.end(), chunk, chunk + got) ;
+   fclose(fp) ;
+   unsigned long long queries = 0, differ = 0 ;
+   int a = 0, descendFrom = -1 ;
+   double starttime = get_wall_time() ;
+   for (size_t i=0; i+3 <= q.size(); ) {
+      int b = q[i++] ;
+      if (b >> 1) {
+         a += (b >> 1) - 64 ;
+      } else {
+         if (i + sizeof(a) + 2 > q.size())
+            break ;
+         memcpy(&a, &q[i], sizeof(a)) ;
+         i += sizeof(a) ;
+      }
+      uint16_t r ;
+      memcpy(&r, &q[i], sizeof(r)) ;
+      row_t row = r ;
+      i += sizeof(r) ;
+      if (a < 2 * period || a > sp[P_DEPTH_LIMIT])
+         return "Trace row index out of range" ;
+      phase = a % period ;
+      if (descendFrom == a - 1) {    // as search() does on accepting a row
+         int ph = phase ;
+         getoffsetcount<1>(pRows[a - 2 * period],
+                        pRows[a - period],
+#ifdef KNIGHT
+                        pRows[a - period + backOff[ph]] >> kshiftb[ph],
+#else
+                        pRows[a - period + backOff[ph]],
+#endif
+                        pInd[a], pRemain[a], pMir[a]) ;
+      }
+      // lookAhead() may refer to this row by its place in the list
+      int k = pRemain[a] ;
+      while (k > 0 && unfold(pMir[a], pInd[a][k]) != row)
+         k-- ;
+      pRemain[a] = k ;
+      pRows[a] = row ;
+      int ok = lookAhead(a) ;
+      if (ok != (b & 1))
+         differ++ ;
+      queries++ ;
+      descendFrom = (b & 1) ? a : -1 ;
+   }
+   double t = get_wall_time() - starttime ;
+   sprintf(errbuf, "Replayed %llu queries in %f seconds: %.1f ns/query", queries, t,
+           queries ? 1e9 * t / queries : 0.0) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "Lookahead cache: %llu lookups, %.2f%% hits", cacheLookups,
+           cacheLookups ? 100.0 * cacheHits / cacheLookups : 0.0) ;
+   listener->message(*this, errbuf) ;
+   if (memo) {
+      sprintf(errbuf, "Inner lookahead memo: %llu lookups, %.2f%% hits", memoLookups,
+              memoLookups ? 100.0 * memoHits / memoLookups : 0.0) ;
+      listener->message(*this, errbuf) ;
+   }
+   char stats[200] ;
+   sprintf(errbuf, "Successor lists: %s", rt->listStats(stats)) ;
+   listener->message(*this, errbuf) ;
+   sprintf(errbuf, "Results differing from the recording: %llu", differ) ;
+   listener->message(*this, errbuf) ;
+   return 0 ;
 }
 
-void echoParams(){
+void Searcher::echoParams(){
    int i,j;
-   printf("Rule: %s\n", rule) ;
+   printf("Rule: %s\n", rt->rule) ;
    printf("Period: %d\n",sp[P_PERIOD]);
    printf("Offset: %d\n",sp[P_OFFSET]);
    printf("Width:  %d\n",sp[P_WIDTH]);
@@ -1030,6 +4158,7 @@ void echoParams(){
    if(!sp[P_REORDER]) printf("Use naive search order.\n");
    if (sp[P_REORDER] == 2) printf("Use randomized search order.\n");
    if (sp[P_REORDER] == 3) printf("Use min population search order.\n");
+   if (sp[P_REORDER] == 4) printf("Use successor-weighted search order (%d population classes).\n", rt->contexts);
    if(sp[P_INIT_ROWS]){
       printf("Initial rows:\n");
       for(i = 0; i < 2 * period; i++){
@@ -1039,6 +4168,149 @@ void echoParams(){
    }
 }
 
+/*
+ *   Convert a pattern as rendered by buffPattern() (rows of o and .
+ *   ending with a Length: line) into standard RLE, header included.
+ */
+std::string patternToRLE(const char *pat, const char *rule) {
+   std::string body ;
+   int w = 0, h = 0, blankRows = 0 ;
+   const char *p = pat ;
+   while (*p == 'o' || *p == '.') {
+      const char *e = p ;
+      while (*e == 'o' || *e == '.')
+         e++ ;
+      if (e - p > w)
+         w = e - p ;
+      h++ ;
+      const char *last = e ;        // trailing dead cells are implicit
+      while (last > p && last[-1] == '.')
+         last-- ;
+      if (last == p) {
+         blankRows++ ;
+      } else {
+         if (h > 1) {
+            if (blankRows + 1 > 1)
+               body += std::to_string(blankRows + 1) ;
+            body += '$' ;
+         }
+         blankRows = 0 ;
+         while (p < last) {
+            const char *q = p ;
+            while (q < last && *q == *p)
+               q++ ;
+            if (q - p > 1)
+               body += std::to_string(q - p) ;
+            body += (*p == 'o') ? 'o' : 'b' ;
+            p = q ;
+         }
+      }
+      p = e ;
+      if (*p == '\n')
+         p++ ;
+   }
+   body += '!' ;
+   return "x = " + std::to_string(w) + ", y = " + std::to_string(h) +
+          ", rule = " + rule + "\n" + body ;
+}
+
+/*
+ *   Listener that, besides the usual output, appends one JSON record per
+ *   ship (and one when the search ends) to a file.  Each record is
+ *   buffered while it is written and flushed when it is complete; ships
+ *   are rare, so this costs nothing, and a crash loses at most the
+ *   record being written.
+ */
+class JsonSink : public SearchListener {
+public:
+   JsonSink() : fp(0) {}
+   ~JsonSink() { if (fp) fclose(fp) ; }
+   const char *open(const char *filename) ;
+   virtual void ship(Searcher &s, const char *pat, int shipCount) ;
+   virtual void finished(Searcher &s, int result, int shipCount, int depth) ;
+private:
+   void beginRecord(Searcher &s, const char *type) ;
+   void endRecord() ;
+   FILE *fp ;
+} ;
+
+const char *JsonSink::open(const char *filename) {
+   fp = fopen(filename, "a") ;
+   if (fp == 0)
+      return "Could not open result file" ;
+   setvbuf(fp, 0, _IOFBF, 1 << 16) ;
+   return 0 ;
+}
+
+static void jsonString(FILE *fp, const char *key, const char *v) {
+   fprintf(fp, ",\"%s\":\"", key) ;
+   for (; *v; v++)
+      if (*v == '\n')
+         fputs("\\n", fp) ;
+      else if (*v == '"' || *v == '\\')
+         fprintf(fp, "\\%c", *v) ;
+      else
+         fputc(*v, fp) ;
+   fputc('"', fp) ;
+}
+
+void JsonSink::beginRecord(Searcher &s, const char *type) {
+   static const char *symnames[] = { "", "asymmetric", "odd", "even", "gutter" } ;
+   char speed[64], stamp[32] ;
+   time_t now = time(0) ;
+   strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now)) ;
+   if (s.sp[P_X_OFFSET])
+      sprintf(speed, "(%d,%d)c/%d", s.sp[P_OFFSET], s.sp[P_X_OFFSET], s.period) ;
+   else if (s.sp[P_OFFSET] == 1)
+      sprintf(speed, "c/%d", s.period) ;
+   else
+      sprintf(speed, "%dc/%d", s.sp[P_OFFSET], s.period) ;
+   fprintf(fp, "{\"type\":\"%s\"", type) ;
+   jsonString(fp, "rule", s.rt->rule) ;
+   jsonString(fp, "speed", speed) ;
+   fprintf(fp, ",\"period\":%d,\"offset\":%d,\"width\":%d",
+           s.period, s.sp[P_OFFSET], s.width) ;
+   jsonString(fp, "symmetry", symnames[s.sp[P_SYMMETRY]]) ;
+   fprintf(fp, ",\"calcs\":%llu", s.calcs) ;
+   jsonString(fp, "time", stamp) ;
+}
+
+void JsonSink::endRecord() {
+   fputs("}\n", fp) ;
+   fflush(fp) ;
+}
+
+void JsonSink::ship(Searcher &s, const char *pat, int shipCount) {
+   SearchListener::ship(s, pat, shipCount) ;
+   if (fp == 0)
+      return ;
+   const char *len = strstr(pat, "Length: ") ;
+   beginRecord(s, "ship") ;
+   fprintf(fp, ",\"ship\":%d,\"length\":%d", shipCount, len ? atoi(len + 8) : 0) ;
+   jsonString(fp, "rle", patternToRLE(pat, s.rt->rule).c_str()) ;
+   endRecord() ;
+}
+
+void JsonSink::finished(Searcher &s, int result, int shipCount, int depth) {
+   static const char *results[] = { "complete", "ships", "depth", "error", "limit" } ;
+   SearchListener::finished(s, result, shipCount, depth) ;
+   if (fp == 0)
+      return ;
+   beginRecord(s, "end") ;
+   jsonString(fp, "result", results[result]) ;
+   fprintf(fp, ",\"ships\":%d", shipCount) ;
+   if (s.knownShips)
+      fprintf(fp, ",\"repeats\":%d", s.knownShips) ;
+   endRecord() ;
+}
+
+#ifndef NTZFIND_LIBRARY
+Searcher *sigSearcher ;
+void requestReport(int) {
+   if (sigSearcher)
+      sigSearcher->reportPending = 1 ;
+}
+
 void usage(){
    printf("%s\n",BANNER);
    printf("\n");
@@ -1092,6 +4364,443 @@ void usage(){
 // printf("  p    outputs the pattern representing the loaded state\n");
    printf("  RNNN restricts memory usage to NNN megabytes\n") ;
    printf("  CNNN uses about NNN megabytes for lookahead cache\n") ;
+   printf("  Ca   sizes the lookahead cache to fit the R memory limit\n") ;
+   printf("  q    prints the expected memory use and exits\n") ;
+   printf("  z FF appends each ship found, as a JSON record with RLE, to file FF\n") ;
+   printf("  hNN  uses NN threads to build the tables (default: all cores)\n") ;
+   printf("  y    builds the whole table up front rather than as needed\n") ;
+   printf("  iNN  reports progress every NN seconds\n") ;
+#ifdef SIGUSR1
+   printf("       (a report can also be requested at any time with SIGUSR1)\n") ;
+#endif
+   printf("  --capture FF  records every lookahead query to trace file FF\n") ;
+   printf("  --replay FF   reruns the queries in trace file FF and reports timing\n") ;
+   printf("                (other options except R, C, h, y, --memo and --lists are ignored)\n") ;
+   printf("  --memo NN     memoizes large inner lookahead probes in NN megabytes\n") ;
+   printf("  --queue NN    searches breadth-first in a queue of NN megabytes, probing\n") ;
+   printf("                depth-first to prune it when full; finds the shortest\n") ;
+   printf("                ships first (f isn't supported; --interleave is ignored)\n") ;
+   printf("  --lds NN      searches in passes, first following the search order at\n") ;
+   printf("                every level, then allowing 1, 2, ... NN departures from it,\n") ;
+   printf("                then without limit (--interleave is ignored)\n") ;
+   printf("  --relayout NN  after NN seconds of search, moves the successor lists\n") ;
+   printf("                into one block, the most read first, and frees the list\n") ;
+   printf("                index (later lists aren't deduplicated)\n") ;
+   printf("  --profile NN  counts reads of the table and reports how it was used,\n") ;
+   printf("                with the NN most read entries, at the end and on SIGUSR1\n") ;
+   printf("  --seeds FF    extends each set of 2*period rows in file FF in turn\n") ;
+   printf("                (in parallel on h threads if the table is built with y)\n") ;
+   printf("  --interleave NN  with --seeds, keeps NN seeds going at once on each\n") ;
+   printf("                thread, so one's table loads overlap another's work\n") ;
+   printf("  --rules FF    searches each rule listed in file FF in turn\n") ;
+   printf("                (h of them at a time; rules with the same table are\n") ;
+   printf("                searched once)\n") ;
+   printf("  --widths NN   searches width w, then w+1 and so on up to NN, until s\n") ;
+   printf("                ships are found; ships that fit a narrower width are\n") ;
+   printf("                reported only there\n") ;
+   printf("  --known FF    reports only ships not already in file FF, and adds them\n") ;
+   printf("                (repeats in another phase or mirrored count as known)\n") ;
+   printf("  --skip-known FF  as --known, and doesn't look for tagalongs on repeats\n") ;
+   printf("  --control FF  every few seconds (and on SIGUSR1) applies the options m,\n") ;
+   printf("                t, s and l in file FF to the rest of the search if they\n") ;
+   printf("                tighten it; looser values are ignored\n") ;
+   printf("  --campaign FF  answers searches from the index of finished searches in\n") ;
+   printf("                file FF where it can, and adds the others to it (not\n") ;
+   printf("                with --seeds or e)\n") ;
+   printf("  --max-calcs NN  stops each search after NN calculations\n") ;
+   printf("  --max-time NN   stops each search after about NN seconds\n") ;
+   printf("  --lists compact  stores successor lists as a bitmap with a rank index,\n") ;
+   printf("                which takes much less memory from about w10 up\n") ;
+   printf("  --mirror fold  stores one list for each mirror-image pair of rows in\n") ;
+   printf("                asymmetric searches, for about half the list memory\n") ;
+   printf("                and build time (the search order changes a little)\n") ;
+   printf("  --shared NAME  keeps the table in shared memory NAME (e.g. /ntz10), so\n") ;
+   printf("                searches of the same rule and width share it; the first\n") ;
+   printf("                one sizes it to R.  Remove it with rm /dev/shm/NAME\n") ;
+   printf("  --context NN  weights the search order by successor counts, with a\n") ;
+   printf("                separate order for NN row population classes (1 is best)\n") ;
+}
+
+/*
+ *   Passes on what one of the searches of a batch (--seeds or --rules)
+ *   finds, labelled and one at a time, and keeps the final tally for
+ *   its summary line.
+ */
+class BatchListener : public SearchListener {
+public:
+   BatchListener(const char *label, SearchListener *out, std::mutex &lock) :
+      label(label), out(out), lock(lock) {}
+   virtual void partial(Searcher &, const char *) {}
+   virtual void progress(Searcher &, int, unsigned long long, double) {}
+   virtual void finished(Searcher &, int, int shipCount, int depth) {
+      ships = shipCount ;
+      this->depth = depth ;
+   }
+   virtual void ship(Searcher &s, const char *pat, int shipCount) {
+      std::lock_guard<std::mutex> g(lock) ;
+      printf("\n%s:", label) ;
+      out->ship(s, pat, shipCount) ;
+   }
+   virtual void message(Searcher &s, const char *msg) {
+      std::lock_guard<std::mutex> g(lock) ;
+      printf("%s: ", label) ;
+      out->message(s, msg) ;
+   }
+   const char *label ;
+   int ships, depth ;
+   SearchListener *out ;
+   std::mutex &lock ;
+} ;
+
+static const char *batchResults[] = { "dead", "ships", "depth", "error", "limit" } ;
+
+/*
+ *   Seeds mode: a file of many initial row sets (2*period rows each, in
+ *   the format of the e option; blank lines and lines starting with #
+ *   are skipped), each searched as its own root with the same
+ *   parameters and budget over one shared table.  With an eagerly built
+ *   table (y) the seeds are spread over the h threads; a lazily built
+ *   one can only be used by one thread, so they run in turn.  With
+ *   interleave above 1 each thread keeps that many seeds going at once,
+ *   switching between them with step() so one's table loads overlap the
+ *   others' work; each seed is searched exactly as it would be alone,
+ *   but they may finish in a different order.
+ */
+struct SeedRun {
+   SeedRun(int i, RuleTable &rt, SearchListener *out, std::mutex &lock) :
+      seed(i), listener(label, out, lock), s(rt, &listener) {
+      sprintf(label, "Seed %d", i + 1) ;
+      listener.ships = 0 ;
+   }
+   int seed ;
+   char label[32] ;
+   BatchListener listener ;
+   Searcher s ;
+} ;
+int runSeeds(const char *file, Searcher &proto, const int *sp, SearchListener *out, int interleave){
+   FILE *fp = fopen(file, "r") ;
+   if (fp == 0) {
+      printf("Could not open seeds file %s\n", file) ;
+      return 10 ;
+   }
+   int n = 2 * proto.period ;
+   std::vector<row_t> rows ;
+   char line[1024], rowStr[256] ;
+   while (fgets(line, sizeof(line), fp))
+      if (sscanf(line, "%255s", rowStr) == 1 && rowStr[0] != '#')
+         rows.push_back(parseRow(rowStr, proto.width)) ;
+   fclose(fp) ;
+   if (rows.size() % n) {
+      printf("Seeds file %s ends partway through a seed\n", file) ;
+      return 10 ;
+   }
+   int seeds = rows.size() / n ;
+   RuleTable *rt = proto.rt ;
+   const char *err = rt->build(proto.width, proto.sp[P_SYMMETRY], proto.sp[P_REORDER]) ;
+   if (err) {
+      printf("%s\n", err) ;
+      return 10 ;
+   }
+   char stats[200] ;
+   printf("Table setup: %f seconds (%d threads%s); %s\n", rt->buildTime,
+          rt->threads, rt->eager ? ", eager" : "", rt->listStats(stats)) ;
+   printf("Extending %d seeds\n", seeds) ;
+   fflush(stdout) ;
+   int counts[5] = { 0, 0, 0, 0, 0 } ;
+   std::mutex lock ;
+   int next = 0 ;
+   // set up seed i to run; 0 if it fails, which is reported here
+   auto begin = [&](int i) {
+      SeedRun *r = new SeedRun(i, *rt, out, lock) ;
+      Searcher &s = r->s ;
+      s.maxCalcs = proto.maxCalcs ;
+      s.maxSeconds = proto.maxSeconds ;
+      s.known = proto.known ;
+      s.cachemem = proto.cachemem < 0 ? 32 : proto.cachemem ;
+      s.memomem = proto.memomem ;
+      s.queuemem = proto.queuemem ;
+      s.ldsMax = proto.ldsMax ;
+      const char *err = s.init(sp, 0) ;
+      if (err == 0) {
+         s.setInitRows(&rows[(long long)i * n]) ;
+         err = s.start() ;
+      }
+      if (err) {
+         std::lock_guard<std::mutex> g(lock) ;
+         counts[SEARCH_ERROR]++ ;
+         printf("%s: %s (%s)\n", r->label, batchResults[SEARCH_ERROR], err) ;
+         fflush(stdout) ;
+         delete r ;
+         return (SeedRun *)0 ;
+      }
+      return r ;
+   } ;
+   auto finish = [&](SeedRun *r, int result) {
+      Searcher &s = r->s ;
+      const char *err = s.lastError ;
+      // a search that ran out of room having found ships still found them
+      if (result == SEARCH_COMPLETE && r->listener.ships)
+         result = SEARCH_SHIPS ;
+      std::lock_guard<std::mutex> g(lock) ;
+      counts[result]++ ;
+      printf("%s: %s", r->label, batchResults[result]) ;
+      if (result == SEARCH_ERROR)
+         printf(" (%s)", err ? err : "") ;
+      else
+         printf(", %d ships, %llu calculations", r->listener.ships, s.calcs) ;
+      if (s.knownShips)
+         printf(", %d repeats", s.knownShips) ;
+      printf("\n") ;
+      fflush(stdout) ;
+      delete r ;
+   } ;
+   runThreads(rt->eager ? rt->threads : 1, [&](int) {
+      std::vector<SeedRun *> running ;
+      while (1) {
+         while ((int)running.size() < interleave) {
+            int i ;
+            {
+               std::lock_guard<std::mutex> g(lock) ;
+               if (next >= seeds)
+                  break ;
+               i = next++ ;
+            }
+            SeedRun *r = begin(i) ;
+            if (r == 0)
+               continue ;
+            if (interleave == 1) {
+               finish(r, r->s.search()) ;
+               continue ;
+            }
+            r->s.beginSearch() ;
+            running.push_back(r) ;
+         }
+         if (running.empty())
+            return ;
+         for (size_t k=0; k<running.size(); ) {
+            int result = running[k]->s.step() ;
+            if (result == SEARCH_RUNNING) {
+               k++ ;
+               continue ;
+            }
+            finish(running[k], result) ;
+            running.erase(running.begin() + k) ;
+         }
+      }
+   }) ;
+   printf("Seeds: %d with ships, %d dead, %d at the depth limit, %d out of budget, %d failed\n",
+          counts[SEARCH_SHIPS], counts[SEARCH_COMPLETE], counts[SEARCH_DEPTH],
+          counts[SEARCH_LIMIT], counts[SEARCH_ERROR]) ;
+   return 0 ;
+}
+
+/*
+ *   Rule sweep: a file of rules, one per line (blank lines and lines
+ *   starting with # are skipped), each searched with the same parameters
+ *   and budget.  Every rule gets its own table, so the rules are spread
+ *   over the h threads whether or not the tables are built eagerly, and
+ *   each table is built on a single thread with an even share of the R
+ *   memory limit.  Rules that spell the same transition table differently
+ *   (B3/S23 and B3aceijknqry/S2-/S3, say) are searched once and share the
+ *   result.
+ */
+int runRules(const char *file, Searcher &proto, const int *sp, SearchListener *out){
+   FILE *fp = fopen(file, "r") ;
+   if (fp == 0) {
+      printf("Could not open rules file %s\n", file) ;
+      return 10 ;
+   }
+   std::vector<std::string> rules ;
+   std::vector<const char *> errs ;
+   std::vector<int> same ;            // earlier rule with the same table, or -1
+   std::unordered_map<std::string, int> tables ;
+   char line[1024], ruleStr[256] ;
+   while (fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "%255s", ruleStr) != 1 || ruleStr[0] == '#')
+         continue ;
+      RuleTable scratch ;
+      const char *err = scratch.setRule(ruleStr) ;
+      std::string key(scratch.nttable2, sizeof(scratch.nttable2)) ;
+      int first = -1 ;
+      if (err == 0) {
+         if (tables.count(key))
+            first = tables[key] ;
+         else
+            tables[key] = rules.size() ;
+      }
+      rules.push_back(ruleStr) ;
+      errs.push_back(err) ;
+      same.push_back(first) ;
+   }
+   fclose(fp) ;
+   int n = rules.size() ;
+   std::vector<int> todo ;
+   for (int i=0; i<n; i++)
+      if (errs[i] == 0 && same[i] < 0)
+         todo.push_back(i) ;
+   int workers = proto.rt->threads ;
+   if (workers > (int)todo.size())
+      workers = todo.size() ;
+   if (workers < 1)
+      workers = 1 ;
+   printf("Sweeping %d rules (%d distinct) on %d threads\n", n, (int)todo.size(), workers) ;
+   fflush(stdout) ;
+   int counts[5] = { 0, 0, 0, 0, 0 } ;
+   std::mutex lock ;
+   for (int i=0; i<n; i++)
+      if (errs[i]) {
+         counts[SEARCH_ERROR]++ ;
+         printf("Rule %s: error (%s)\n", rules[i].c_str(), errs[i]) ;
+      }
+   int next = 0 ;
+   runThreads(workers, [&](int) {
+      while (1) {
+         int i ;
+         {
+            std::lock_guard<std::mutex> g(lock) ;
+            if (next >= (int)todo.size())
+               return ;
+            i = todo[next++] ;
+         }
+         char label[300] ;
+         sprintf(label, "Rule %s", rules[i].c_str()) ;
+         BatchListener listener(label, out, lock) ;
+         RuleTable rt ;
+         rt.setRule(rules[i].c_str()) ;
+         rt.threads = 1 ;
+         rt.eager = proto.rt->eager ;
+         rt.contexts = proto.rt->contexts ;
+         rt.compact = proto.rt->compact ;
+         rt.fold = proto.rt->fold ;
+         rt.memlimit = proto.rt->memlimit / workers ;
+         Searcher s(rt, &listener) ;
+         s.maxCalcs = proto.maxCalcs ;
+         s.maxSeconds = proto.maxSeconds ;
+         s.known = proto.known ;
+         s.campaign = proto.campaign ;
+         s.cachemem = proto.cachemem < 0 ? 32 : proto.cachemem ;
+         s.memomem = proto.memomem ;
+         s.queuemem = proto.queuemem ;
+         s.ldsMax = proto.ldsMax ;
+         int result = SEARCH_ERROR ;
+         listener.ships = 0 ;
+         const char *err = s.init(sp, 0) ;
+         if (err == 0 && proto.sp[P_INIT_ROWS])
+            s.setInitRows(proto.pRows) ;
+         // built here rather than by start() to keep its setup message out
+         // of the sweep's one line per rule
+         if (err == 0)
+            err = rt.build(s.width, s.sp[P_SYMMETRY], s.sp[P_REORDER]) ;
+         if (err == 0)
+            err = s.start() ;
+         if (err == 0) {
+            result = s.search() ;
+            err = s.lastError ;
+         }
+         if (result == SEARCH_COMPLETE && listener.ships)
+            result = SEARCH_SHIPS ;
+         std::lock_guard<std::mutex> g(lock) ;
+         for (int j=i; j<n; j++) {
+            if (j != i && same[j] != i)
+               continue ;
+            counts[result]++ ;
+            printf("Rule %s: %s", rules[j].c_str(), batchResults[result]) ;
+            if (result == SEARCH_ERROR)
+               printf(" (%s)", err ? err : "") ;
+            else
+               printf(", %d ships, %llu calculations", listener.ships, s.calcs) ;
+            if (s.knownShips)
+               printf(", %d repeats", s.knownShips) ;
+            if (j != i)
+               printf(" (same table as %s)", rules[i].c_str()) ;
+            printf("\n") ;
+         }
+         fflush(stdout) ;
+      }
+   }) ;
+   printf("Rules: %d with ships, %d dead, %d at the depth limit, %d out of budget, %d failed\n",
+          counts[SEARCH_SHIPS], counts[SEARCH_COMPLETE], counts[SEARCH_DEPTH],
+          counts[SEARCH_LIMIT], counts[SEARCH_ERROR]) ;
+   return 0 ;
+}
+
+/*
+ *   Width sweep: search width w, then w+1 and so on up to lastWidth, in
+ *   one process, stopping once s ships have been found in all.  A ship
+ *   that fits a narrower width turns up again at every wider one (a
+ *   narrower search is the wider one restricted to rows that leave the
+ *   outer column empty), and shipKey() ignores the empty columns, so
+ *   the widths share a KnownShips and each ship is reported only at the
+ *   width it first fits.  Nothing else carries over soundly: any
+ *   partial of the wider search can still grow into the new column, so
+ *   no subtree can be skipped because the narrower search exhausted it,
+ *   and every list depends on the width, so each table is built afresh
+ *   (after the last one is freed).
+ */
+int runWidths(int lastWidth, Searcher &proto, const int *sp, SearchListener *out){
+   KnownShips own ;
+   KnownShips *known = proto.known ? proto.known : &own ;
+   int params[NUM_PARAMS] ;
+   memcpy(params, sp, sizeof(params)) ;
+   int wanted = sp[P_NUM_SHIPS] ;     // 0 or less: find all at every width
+   int found = 0 ;
+   std::mutex lock ;
+   printf("Sweeping widths %d to %d\n", sp[P_WIDTH], lastWidth) ;
+   fflush(stdout) ;
+   for (int w=sp[P_WIDTH]; w<=lastWidth; w++) {
+      char label[32] ;
+      sprintf(label, "Width %d", w) ;
+      BatchListener listener(label, out, lock) ;
+      RuleTable rt ;
+      rt.setRule(proto.rt->rule) ;
+      rt.threads = proto.rt->threads ;
+      rt.eager = proto.rt->eager ;
+      rt.contexts = proto.rt->contexts ;
+      rt.compact = proto.rt->compact ;
+      rt.fold = proto.rt->fold ;
+      rt.memlimit = proto.rt->memlimit ;
+      Searcher s(rt, &listener) ;
+      s.maxCalcs = proto.maxCalcs ;
+      s.maxSeconds = proto.maxSeconds ;
+      s.known = known ;
+      s.campaign = proto.campaign ;
+      s.cachemem = proto.cachemem ;
+      s.memomem = proto.memomem ;
+      s.queuemem = proto.queuemem ;
+      s.ldsMax = proto.ldsMax ;
+      s.reportInterval = proto.reportInterval ;
+      s.profile = proto.profile ;
+      params[P_WIDTH] = w ;
+      params[P_NUM_SHIPS] = wanted > 0 ? wanted - found : wanted ;
+      int result = SEARCH_ERROR ;
+      listener.ships = 0 ;
+      double t = get_wall_time() ;
+      const char *err = "An initial rows file can't be used across widths" ;
+      if (!proto.sp[P_INIT_ROWS])
+         err = s.init(params, 0) ;
+      if (err == 0)
+         err = s.start() ;
+      if (err == 0) {
+         result = s.search() ;
+         err = s.lastError ;
+      }
+      if (result == SEARCH_COMPLETE && listener.ships)
+         result = SEARCH_SHIPS ;
+      found += listener.ships ;
+      printf("Width %d: %s", w, batchResults[result]) ;
+      if (result == SEARCH_ERROR)
+         printf(" (%s)", err ? err : "") ;
+      else
+         printf(", %d new ships, %llu calculations, %.2f seconds", listener.ships, s.calcs, get_wall_time() - t) ;
+      if (s.knownShips)
+         printf(", %d repeats of ships already %s", s.knownShips, proto.known ? "known or reported" : "reported") ;
+      printf("\n") ;
+      fflush(stdout) ;
+      if (result == SEARCH_ERROR || (wanted > 0 && found >= wanted))
+         break ;
+   }
+   printf("Widths: %d ships found\n", found) ;
+   return 0 ;
 }
 
 int main(int argc, char *argv[]){
@@ -1100,32 +4809,31 @@ int main(int argc, char *argv[]){
    for (int i=0; i<argc; i++)
       printf(" %s", argv[i]) ;
    printf("\n") ;
-   sp[P_WIDTH] = 0;
-   sp[P_PERIOD] = 0;
-   sp[P_OFFSET] = 0;
+   int sp[NUM_PARAMS] ;
+   for (int i=0; i<NUM_PARAMS; i++)
+      sp[i] = 0 ;
    sp[P_DEPTH_LIMIT] = DEFAULT_DEPTH_LIMIT;
-   sp[P_SYMMETRY] = 0;
-   sp[P_MAX_LENGTH] = 0;
-   sp[P_INIT_ROWS] = 0;
-   sp[P_FULL_PERIOD] = 0;
    sp[P_NUM_SHIPS] = 1;
-   sp[P_FULL_WIDTH] = 0;
    sp[P_REORDER] = 1;
-   sp[P_DUMP] = 0;
-   sp[P_X_OFFSET] = 0 ;
-   sp[P_KNIGHT_PHASE] = 0 ;
-   loadDumpFlag = 0;
-   dumpPeriod = 0xffffffffffffffff;  // default dump period is 2^64, so the state will never be dumped
+   int loadDumpFlag = 0;
    int dumpandexit = 0;
+   int planonly = 0;
    int skipNext = 0;
-   int div1,div2;
+   const char *captureFile = 0, *replayFile = 0, *seedsFile = 0, *rulesFile = 0 ;
+   int lastWidth = 0 ;
    int s;
+   long long memlimit = 0 ;
+   int interleave = 1 ;
+   RuleTable rt ;
+   JsonSink sink ;
+   KnownShips known ;
+   Campaign campaign ;
+   Searcher searcher(rt, &sink) ;
    if(argc == 2 && !strcmp(argv[1],"c")){
       usage();
       return 0;
    }
    const char *err ;
-   parseRule(rule, nttable) ; // pick up default rule
    if(argc == 3 && (!strcmp(argv[1],"s") || !strcmp(argv[1],"S") || !strcmp(argv[1],"p") || !strcmp(argv[1],"P"))) loadDumpFlag = 1;
    else{
       for(s = 1; s < argc; s++){    //read input parameters
@@ -1133,11 +4841,9 @@ int main(int argc, char *argv[]){
             skipNext = 0;
             continue;
          }
-         int sshift ;
          switch(argv[s][0]){
             case 'b': case 'B':     //read rule
-               rule = argv[s] ;
-               err = parseRule(argv[s], nttable) ;
+               err = rt.setRule(argv[s]) ;
                if (err != 0) {
                   fprintf(stderr, "Failed to parse rule %s\n", argv[s]) ;
                   exit(10) ;
@@ -1155,6 +4861,13 @@ int main(int argc, char *argv[]){
             case 'd': case 'D': sscanf(&argv[s][1], "%d", &sp[P_DUMP]); break;
             case 'j': case 'J': dumpandexit = 1; break;
             case 'e': case 'E': sp[P_INIT_ROWS] = s + 1; skipNext = 1; break;
+            case 'z': case 'Z':
+               if (s + 1 >= argc || (err = sink.open(argv[s+1])) != 0) {
+                  printf("Could not open result file\n") ;
+                  exit(10) ;
+               }
+               skipNext = 1;
+            break;
             case 'f': case 'F': sscanf(&argv[s][1], "%d", &sp[P_FULL_PERIOD]); break;
             case 's': case 'S': sscanf(&argv[s][1], "%d", &sp[P_NUM_SHIPS]); break;
             case 't': case 'T': sscanf(&argv[s][1], "%d", &sp[P_FULL_WIDTH]); break;
@@ -1164,67 +4877,158 @@ int main(int argc, char *argv[]){
             case 'N': sscanf(&argv[s][1], "%d", &sp[P_KNIGHT_PHASE]); break;
 
             case 'n':           sp[P_REORDER] = 3; break;
-            case 'R': sscanf(&argv[s][1], "%lld", &memlimit) ; memlimit <<= 20 ; break ;
-            case 'C': sscanf(&argv[s][1], "%d", &cachemem); break ;
+            case 'R': sscanf(&argv[s][1], "%lld", &memlimit) ; rt.memlimit = memlimit << 20 ; break ;
+            case 'C':
+               if (argv[s][1] == 'a' || argv[s][1] == 'A') searcher.cachemem = -1;
+               else sscanf(&argv[s][1], "%d", &searcher.cachemem);
+            break ;
+            case 'q': case 'Q': planonly = 1; break ;
+            case 'i': case 'I': sscanf(&argv[s][1], "%d", &searcher.reportInterval); break ;
+            case 'h': case 'H': sscanf(&argv[s][1], "%d", &rt.threads); if (rt.threads < 1) rt.threads = 1; break ;
+            case 'y': case 'Y': rt.eager = 1; break ;
+            case '-':
+               if (s + 1 < argc && !strcmp(argv[s], "--capture")) captureFile = argv[s+1];
+               else if (s + 1 < argc && !strcmp(argv[s], "--memo")) sscanf(argv[s+1], "%d", &searcher.memomem);
+               else if (s + 1 < argc && !strcmp(argv[s], "--queue")) sscanf(argv[s+1], "%d", &searcher.queuemem);
+               else if (s + 1 < argc && !strcmp(argv[s], "--lds")) {
+                  sscanf(argv[s+1], "%d", &searcher.ldsMax);
+                  if (searcher.ldsMax < 0) searcher.ldsMax = 0;
+               }
+               else if (s + 1 < argc && !strcmp(argv[s], "--relayout")) sscanf(argv[s+1], "%d", &searcher.relayoutSeconds);
+               else if (s + 1 < argc && !strcmp(argv[s], "--profile")) {
+                  sscanf(argv[s+1], "%d", &searcher.profile);
+                  if (searcher.profile < 0) searcher.profile = 0;
+               }
+               else if (s + 1 < argc && !strcmp(argv[s], "--seeds")) seedsFile = argv[s+1];
+               else if (s + 1 < argc && !strcmp(argv[s], "--rules")) rulesFile = argv[s+1];
+               else if (s + 1 < argc && !strcmp(argv[s], "--widths")) sscanf(argv[s+1], "%d", &lastWidth);
+               else if (s + 1 < argc && !strcmp(argv[s], "--interleave")) {
+                  sscanf(argv[s+1], "%d", &interleave);
+                  if (interleave < 1) interleave = 1;
+               }
+               else if (s + 1 < argc && (!strcmp(argv[s], "--known") || !strcmp(argv[s], "--skip-known"))) {
+                  if ((err = known.open(argv[s+1])) != 0) {
+                     printf("%s\n", err) ;
+                     exit(10) ;
+                  }
+                  known.skip = (argv[s][2] == 's') ;
+                  searcher.known = &known ;
+               }
+               else if (s + 1 < argc && !strcmp(argv[s], "--control")) searcher.controlFile = argv[s+1];
+               else if (s + 1 < argc && !strcmp(argv[s], "--campaign")) {
+                  if ((err = campaign.open(argv[s+1])) != 0) {
+                     printf("%s\n", err) ;
+                     exit(10) ;
+                  }
+                  searcher.campaign = &campaign ;
+               }
+               else if (s + 1 < argc && !strcmp(argv[s], "--max-calcs")) sscanf(argv[s+1], "%llu", &searcher.maxCalcs);
+               else if (s + 1 < argc && !strcmp(argv[s], "--max-time")) sscanf(argv[s+1], "%d", &searcher.maxSeconds);
+               else if (s + 1 < argc && !strcmp(argv[s], "--context")) {
+                  sp[P_REORDER] = 4;
+                  sscanf(argv[s+1], "%d", &rt.contexts);
+               }
+               else if (s + 1 < argc && !strcmp(argv[s], "--replay")) replayFile = argv[s+1];
+               else if (s + 1 < argc && !strcmp(argv[s], "--lists") &&
+                        (!strcmp(argv[s+1], "compact") || !strcmp(argv[s+1], "dense")))
+                  rt.compact = !strcmp(argv[s+1], "compact");
+               else if (s + 1 < argc && !strcmp(argv[s], "--mirror") &&
+                        (!strcmp(argv[s+1], "fold") || !strcmp(argv[s+1], "full")))
+                  rt.fold = !strcmp(argv[s+1], "fold");
+               else if (s + 1 < argc && !strcmp(argv[s], "--shared")) rt.sharedName = argv[s+1];
+               else {
+                  printf("Unrecognized option %s\n", argv[s]) ;
+                  exit(10) ;
+               }
+               skipNext = 1;
+            break;
             default:
                printf("Unrecognized option %s\n", argv[s]) ;
                exit(10) ;
          }
       }
    }
-   fasterTable() ;
-   cachesize = 32768 ;
-   while (cachesize * sizeof(cacheentry) < 550000 * cachemem)
-      cachesize <<= 1 ;
-   memusage += sizeof(cacheentry) * cachesize ;
-   cache = (struct cacheentry *)calloc(sizeof(cacheentry), cachesize) ;
-   if(loadDumpFlag) loadState(argv[1],argv[2]);     //load search state from file
-   else initializeSearch(argv[sp[P_INIT_ROWS]]);    //initialize search based on input parameters
-   if(!sp[P_WIDTH] || !sp[P_PERIOD] || !sp[P_OFFSET] || !sp[P_SYMMETRY]){
-      printf("You must specify a width, period, offset, and symmetry type.\n");
-      printf("For command line options, type 'zfind c'.\n");
+   if(loadDumpFlag){                //load search state from file
+      err = searcher.loadState(argv[1],argv[2]);
+      if (err) {
+         printf("%s\n", err) ;
+         exit(10) ;
+      }
       return 0;
    }
-   echoParams();
-   makePhases();                    //make phase tables for determining successor row indices
-   if(gcd(period,offset) > 1){      //make phase tables for determining equivalent subperiodic rows
-      div1 = smallestDivisor(gcd(period,offset));
-      makeEqRows(period / div1,1);
-      div2 = gcd(period,offset);
-      while(div2 % div1 == 0) div2 /= div1;
-      if(div2 != 1){
-         twoSubPeriods = 1;
-         div2 = smallestDivisor(div2);
-         makeEqRows(period / div2,2);
+   if (replayFile) {
+      err = searcher.replay(replayFile) ;
+      if (err) {
+         printf("%s\n", err) ;
+         exit(10) ;
       }
+      return 0 ;
    }
-#ifdef KNIGHT
-   if (sp[P_X_OFFSET])
-      makekshift(sp[P_KNIGHT_PHASE]) ;
-#endif
-   makeTables();                    //make lookup tables for determining successor rows
-   if(!loadDumpFlag){               //these initialization steps must be performed after makeTables()
-      for (int i=0; i<sp[P_DEPTH_LIMIT]; i++) {
-         pInd[i] = gInd3[0] + gInd3[0][0] ;
-         pRemain[i] = 0 ;
+   err = searcher.init(sp, sp[P_INIT_ROWS] ? argv[sp[P_INIT_ROWS]] : 0);   //initialize search based on input parameters
+   if (err) {
+      printf("%s\n", err);
+      if(!sp[P_WIDTH] || !sp[P_PERIOD] || !sp[P_OFFSET] || !sp[P_SYMMETRY]){
+         printf("For command line options, type 'zfind c'.\n");
+         return 0;
       }
-      pRemain[2 * period] = gInd3[0][1] - gInd3[0][0] - 1 ;
-      pInd[2 * period] = gInd3[0] + gInd3[0][0] ;
-      if(sp[P_INIT_ROWS]){
-         getoffsetcount(pRows[0], pRows[period], pRows[period+backOff[0]],
-                        pInd[2*period], pRemain[2*period]) ;
+      exit(10) ;
+   }
+   searcher.echoParams();
+   if (searcher.campaign && (seedsFile || sp[P_INIT_ROWS])) {
+      printf("A campaign index can't be used with --seeds or initial rows\n") ;
+      exit(10) ;
+   }
+   if (searcher.controlFile && (seedsFile || rulesFile || lastWidth || searcher.queuemem)) {
+      printf("A control file can't be used with --seeds, --rules, --widths or --queue\n") ;
+      exit(10) ;
+   }
+   if (seedsFile && !planonly) {
+      sp[P_INIT_ROWS] = 0;
+      return runSeeds(seedsFile, searcher, sp, &sink, searcher.queuemem || searcher.ldsMax >= 0 ? 1 : interleave);
+   }
+   if (rulesFile && !planonly) {
+      sp[P_INIT_ROWS] = 0;
+      return runRules(rulesFile, searcher, sp, &sink);
+   }
+   if (lastWidth && !planonly)
+      return runWidths(lastWidth, searcher, sp, &sink);
+   if (planonly) {
+      err = searcher.plan(rt.memlimit) ;
+      if (err) {
+         printf("%s\n", err) ;
+         exit(10) ;
       }
+      return 0 ;
+   }
+   err = searcher.start();          //make lookup tables for determining successor rows
+   if (err) {
+      printf("%s\n", err) ;
+      return 0 ;
    }
    if(dumpandexit){
-      dumpState(rowNum);
-      if (dumpFlag == DUMPSUCCESS) printf("State dumped to file %s%04d\n",DUMPROOT,dumpNum - 1);
+      err = searcher.dumpState(searcher.rowNum);
+      if (err) {
+         printf("%s\n", err) ;
+         exit(10) ;
+      }
+      if (searcher.dumpFlag == DUMPSUCCESS) printf("State dumped to file %s%04d\n",DUMPROOT,searcher.dumpNum - 1);
       else printf("Dump failed\n");
       return 0;
    }
-   buf = (char *)calloc((2*sp[P_WIDTH] + 4), sp[P_DEPTH_LIMIT]);  // I think this gives more than enough space
-   buf[0] = '\0';
+   if (captureFile && (err = searcher.startTrace(captureFile)) != 0) {
+      printf("%s\n", err) ;
+      exit(10) ;
+   }
    printf("Starting search\n");
    fflush(stdout) ;
-   search();
+#ifdef SIGUSR1
+   sigSearcher = &searcher ;
+   signal(SIGUSR1, requestReport) ;
+#endif
+   if (searcher.search() == SEARCH_ERROR) {
+      printf("%s\n", searcher.lastError) ;
+      return 0 ;
+   }
    return 0;
 }
+#endif
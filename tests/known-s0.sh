@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+#   A search with --known and s0 (find all) has to finish the tree when
+#   the ships it meets are already known, not stop at the first repeat.
+#   Usage: tests/known-s0.sh ./ntzfind
+#
+NTZFIND=${1:-./ntzfind}
+KNOWN=$(mktemp)
+trap 'rm -f "$KNOWN"' EXIT
+"$NTZFIND" p4 k2 w7 v s0 l90 --known "$KNOWN" > /dev/null || exit 1
+OUT=$("$NTZFIND" p4 k2 w7 v s0 l90 --known "$KNOWN")
+if echo "$OUT" | grep -q "^Search complete: 0 spaceships found" ; then
+   echo "known-s0: ok"
+else
+   echo "known-s0: FAILED"
+   echo "$OUT" | grep -E "^Search|repeats"
+   exit 1
+fi